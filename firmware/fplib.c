@@ -67,3 +67,20 @@ fp16_t fp_inverse(const fp16_t f, int8_t extra_shift)
 	 */
 	return (result & FP16_MANTISSA_MASK) | (u_smallint_t)exp;
 }
+
+fp16_t fp_from_uint32(uint32_t value)
+{
+	/* fp_to_uint32 shifts the mantissa left by exp+1,
+	 * the smallest exponent that fits keeps the most bits
+	 */
+	u_smallint_t exp = 0;
+	value >>= 1;
+	while ( value > 0xFFFF )
+	{
+		if ( exp == FP16_EXPONENT_MAX )
+			return fp_compose(FP16_MANTISSA_MAX, FP16_EXPONENT_MAX);
+		value >>= 1;
+		++exp;
+	}
+	return fp_compose(value, exp);
+}
@@ -34,6 +34,8 @@ inline uint16_t fp_to_uint16(fp16_t f) FORCEINLINE;
 /* computes 2**extra_shift/f */
 fp16_t fp_inverse(fp16_t f, int8_t extra_shift);
 fp16_t fp_normalize(uint16_t sig, int8_t exp);
+/* inverse of fp_to_uint32, bits below the mantissa are dropped */
+fp16_t fp_from_uint32(uint32_t value);
 
 inline fp16_t fp_compose(uint16_t mantissa, uint8_t exponent)
 {
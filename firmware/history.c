@@ -0,0 +1,63 @@
+#include "history.h"
+#include "ucd_api.h"
+
+static ucd_history_report_type s_history = {
+	.period = UCD_HISTORY_PERIOD,
+};
+static uint8_t s_frozen;
+
+static void
+ring_put(uint8_t byte)
+{
+	uint8_t head = s_history.head;
+	s_history.ring[head] = byte;
+	if ( ++head == UCD_HISTORY_SIZE )
+		head = 0;
+	s_history.head = head;
+	if ( s_history.fill != UCD_HISTORY_SIZE )
+		++s_history.fill;
+}
+
+void
+history_append(uint16_t value)
+{
+	/* host is reading the ring, keep it consistent */
+	if ( s_frozen )
+		return;
+
+	if ( s_history.samples )
+	{
+		const uint16_t prev = s_history.last;
+		const int16_t delta = value - prev;
+		if ( delta > 127 || delta < -127 )
+		{
+			/* marker goes last, so it is the first byte seen when reading backwards */
+			ring_put(prev >> 8);
+			ring_put(prev);
+			ring_put(UCD_HISTORY_ESCAPE);
+		}
+		else
+		{
+			ring_put(delta);
+		}
+	}
+	s_history.last = value;
+	if ( s_history.samples != 0xFF )
+		++s_history.samples;
+}
+
+void
+history_freeze(uint8_t frozen)
+{
+	s_frozen = frozen;
+}
+
+uint8_t
+history_read(uint8_t offset, uint8_t *data, uint8_t len)
+{
+	const uint8_t *src = (const uint8_t *)&s_history;
+	uint8_t count = 0;
+	for(; count != len && offset != sizeof(s_history); ++count)
+		*data++ = src[offset++];
+	return count;
+}
@@ -0,0 +1,14 @@
+/**
+ *  on-device history of filtered samples
+ */
+
+#ifndef HISTORY_H_INC
+#define HISTORY_H_INC
+
+#include <stdint.h>
+
+void history_append(uint16_t value);
+void history_freeze(uint8_t frozen);
+uint8_t history_read(uint8_t offset, uint8_t *data, uint8_t len);
+
+#endif /* HISTORY_H_INC */
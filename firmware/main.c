@@ -1,7 +1,21 @@
 /* peripherials */
 #include "compiler.h"
 #include "sampler.h"
+#include "tick.h"
 #include "ucd_api.h"
+#if WITH_HISTORY
+#include "history.h"
+#endif
+#if WITH_OSCCAL
+#include "osccal.h"
+#endif
+#if WITH_PROFILE
+#include "profile.h"
+#endif
+
+#if WITH_HID_SENSOR && WITH_HISTORY
+#error history report is not available in HID Sensor build
+#endif
 
 /* include proper usb driver headers */
 #ifndef USBDRV
@@ -15,10 +29,12 @@
 #endif /* USBDRV */
 
 /* library headers */
-#include <util/delay.h>
 #include <avr/interrupt.h>
 #include <avr/wdt.h>
+#include <avr/sleep.h>
 #include <avr/eeprom.h>
+#include <avr/pgmspace.h>
+#include <util/atomic.h>
 #include <string.h>
 
 /* definitions */
@@ -26,15 +42,100 @@
 #define USBRQ_HID_REPORT_TYPE_OUTPUT 2
 #define USBRQ_HID_REPORT_TYPE_FEATURE 3
 #define HARD_SENSITIVITY_OFFSET 12
+#define DEFAULT_REPORT_INTERVAL 250 /* ms, the cadence before it was a parameter */
+
+/* suspend: low speed keep-alives toggle D- every ms while the bus is alive */
+#define SUSPEND_TIMEOUT 3 /* ms without D- activity */
+#define SUSPEND_PERIOD 256 /* ms between captures while suspended, see suspend_sleep() */
+#define SUSPEND_STEP 32 /* ms of one watchdog sleep */
+
+/* warm start: state in .noinit is trusted after a reset which keeps RAM */
+#define WARM_MAGIC 0x5753
+#define CONFIG_CHECK_SEED 0xA5 /* erased EEPROM and zeroed RAM fail the check */
+#define CONNECT_DELAY 250 /* ms of disconnect for the host to notice */
 
 #define min(a,b) ( ((a)<(b))?(a):(b) )
 
 /* globals */
 NOINIT uint8_t mcusr_mirror;
+static NOINIT uint16_t warm_magic;
+static uint8_t warm_started;
+static volatile uint16_t g_ticks;
 /* globals: reports */
-static uint16_t input_report;
-static uint8_t feature_report[UCD_FEATURE_REPORT_COUNT+1];
+static NOINIT uint16_t filtered_value;
+static NOINIT uint16_t filtered_check; /* ~filtered_value, validates it on warm start */
+#if SAMPLER_CHANNELS > 1
+/* filtered per channel, filtered_value is channel 0 with IR taken off */
+static uint16_t channel_value[SAMPLER_CHANNELS];
+CASSERT(SAMPLER_CHANNELS <= UCD_INPUT_BATCH_SIZE);
+#endif
+static uint16_t report_stamp; /* tick the last batch was queued at */
+#if WITH_HID_SENSOR
+static ucd_sensor_feature_report_type sensor_feature = {
+	.report_id = UCD_SENSOR_REPORT_ID,
+	.reporting_state = UCD_SENSOR_REPORTING_ALL_EVENTS,
+	.power_state = UCD_SENSOR_POWER_D0,
+};
+static ucd_sensor_input_report_type sensor_input = { .report_id = UCD_SENSOR_REPORT_ID };
+static uint16_t sensor_last; /* illuminance sent last */
+static uint8_t sensor_pending; /* sensor_input holds a sample not sent yet */
+#else
+static ucd_input_report_type input_report; /* batch being accumulated */
+static ucd_input_report_type report_tx; /* batch being transmitted */
+static uint16_t event_value; /* last value passed in event mode */
+static uint16_t event_stamp; /* tick of the last value passed in event mode */
 static uint8_t active_subrq_mux;
+#endif
+#if WITH_HISTORY
+static uint16_t history_stamp; /* tick the last history entry was recorded at */
+#endif
+static uint8_t feature_report[UCD_FEATURE_REPORT_COUNT+1];
+static uint8_t vendor_subrq;
+#if WITH_RAW_STREAM
+static ucd_raw_capture_type raw_capture; /* newest capture for endpoint 3 */
+static uint8_t raw_pending;
+#endif
+#if WITH_SUSPEND
+static uint16_t bus_stamp; /* tick of the last bus activity seen */
+static volatile uint8_t bus_resumed; /* set by D- change while suspended */
+#endif
+
+#if !WITH_HID_SENSOR
+/* tracks progress of multi-packet interrupt transfer */
+static struct
+{
+	uint8_t *ptr;
+	uint8_t count;
+}intr_transfer;
+#endif
+
+#if WITH_STATS
+/* runtime statistics kept here, the sampler keeps its own */
+static struct
+{
+	uint16_t reports;
+	uint16_t max_loop; /* ms << 8 | timer0 counts */
+	uint16_t loop_mark; /* fine tick the current iteration started at */
+	uint16_t sample_rate;
+	uint16_t rate_stamp; /* tick the sample rate was taken at */
+	uint16_t rate_mark; /* sample count at rate_stamp */
+}stats;
+#endif
+
+#if WITH_PROFILE
+/* times are timer0 counts, see ucd_profile_request_type */
+typedef struct
+{
+	uint16_t runs;
+	uint16_t min;
+	uint16_t max;
+	uint32_t total;
+}profile_stage_type;
+
+profile_isr_type g_profile_isr[PROFILE_ISR_COUNT];
+static profile_stage_type profile[UCD_PROFILE_STAGES];
+static uint8_t profile_prescaler; /* record only at this prescaler, 0 - at any */
+#endif
 
 /* tracks progress of usb write */
 static struct
@@ -51,15 +152,36 @@ static struct
 	uint8_t count;
 }eeprom_transfer;
 
-/* globals: operating parameters */
-ucd_parameters_request_type g_parameters;
+/* globals: operating parameters, same layout in EEPROM */
+typedef struct
+{
+	ucd_parameters_request_type parameters;
+	uint8_t check; /* see config_check() */
+}config_type;
+
+NOINIT config_type g_config;
+config_type ee_config EEMEM = {
+	.parameters = { .report_interval = DEFAULT_REPORT_INTERVAL },
+	/* config_check() of the above */
+	.check = (uint8_t)(CONFIG_CHECK_SEED + (DEFAULT_REPORT_INTERVAL & 0xFF) + (DEFAULT_REPORT_INTERVAL >> 8)),
+};
+static uint8_t config_pending; /* bytes of g_config, from the end, still to go to EEPROM */
 
 /* we use combined report, INPUT returns data, FEATURE allows for controlling of parameters */
-PROGMEM char usbHidReportDescriptor[49] = {
+PROGMEM char usbHidReportDescriptor[USB_CFG_HID_REPORT_DESCRIPTOR_LENGTH] = {
+#if WITH_HID_SENSOR
+#include "hid_sensor_descriptor.inc"
+#else
 	/* input part */
 	0x06, 0x00, 0xff,              // USAGE_PAGE (Vendor Defined Page 1)
 	0xa1, 0x01,                    // COLLECTION (Application)
 	0x15, 0x00,                    //   LOGICAL_MINIMUM (0)
+	0x26, 0xff, 0x00,              //   LOGICAL_MAXIMUM (255)
+	0x75, 0x08,                    //   REPORT_SIZE (8)
+	0x95, UCD_INPUT_HEADER_SIZE,   //   REPORT_COUNT (4)
+	0x09, UCD_USAGE_HEADER,        //   USAGE(vendor usage 2)
+	0x81, 0x02,                    //   INPUT (Data,Var,Abs)
+
 	0x27, 0xff, 0xff, 0x00, 0x00,  //   LOGICAL_MAXIMUM (65535)
 #if 0
 	0x35, 0x00,                    //   PHYSICAL_MINIMUM (0)
@@ -68,11 +190,12 @@ PROGMEM char usbHidReportDescriptor[49] = {
 	0x67, 0xe1, 0x00, 0x00, 0x01,  //   UNIT (SI Lin:0x10000e1)
 #endif
 	0x75, 0x10,                    //   REPORT_SIZE (16)
-	0x95, 0x01,                    //   REPORT_COUNT (1)
-	0x09, 0x01,                    //   USAGE(vendor usage 1)
+	0x95, UCD_INPUT_BATCH_SIZE,    //   REPORT_COUNT (3)
+	0x09, UCD_USAGE_SAMPLE,        //   USAGE(vendor usage 1)
 	0x82, 0x22, 0x01,              // INPUT (Data,Var,Abs,NPrf,Buf)
+	0x09, UCD_USAGE_STAMP,         //   USAGE(vendor usage 3)
+	0x81, 0x02,                    //   INPUT (Data,Var,Abs)
 
-	0x15, 0x00,                    //   LOGICAL_MINIMUM (0)
 	0x26, 0xff, 0x00,              //   LOGICAL_MAXIMUM (255)
 	0x75, 0x08,                    //   REPORT_SIZE (8)
 	0x85, UCD_SUBRQ_MUX_REPORT_ID, //   REPORT_ID(0)
@@ -86,11 +209,292 @@ PROGMEM char usbHidReportDescriptor[49] = {
 	0x09, 0x00,                    //   USAGE(Undefined)
 	0xb2, 0x02, 0x01,              //   FEATURE(Data,Var,Abs,Buf)
 
+#if WITH_HISTORY
+	0x85, UCD_SUBRQ_HISTORY_REPORT_ID,//   REPORT_ID(3)
+	0x95, sizeof(ucd_history_report_type),//   REPORT_COUNT (39)
+	0x09, 0x00,                    //   USAGE(Undefined)
+	0xb2, 0x02, 0x01,              //   FEATURE(Data,Var,Abs,Buf)
+#endif
+
 	0xc0,
+#endif /* WITH_HID_SENSOR */
+};
+
+#if WITH_RAW_STREAM
+/*
+ * Configuration as V-USB builds it, HID descriptor at offset 18,
+ * plus a vendor class interface for the raw capture endpoint
+ */
+PROGMEM char usbDescriptorConfiguration[] = {
+	9, USBDESCR_CONFIG,
+	USB_PROP_LENGTH(USB_CFG_DESCR_PROPS_CONFIGURATION), 0,
+	2,                             // interfaces
+	1,                             // configuration index
+	0,                             // no name string
+	(1 << 7),                      // bus powered
+	USB_CFG_MAX_BUS_POWER/2,
+
+	9, USBDESCR_INTERFACE,
+	0, 0,                          // interface 0, alternate 0
+	1,                             // endpoints
+	USB_CFG_INTERFACE_CLASS, USB_CFG_INTERFACE_SUBCLASS, USB_CFG_INTERFACE_PROTOCOL,
+	0,
+	9, USBDESCR_HID,
+	0x01, 0x01,                    // HID 1.01
+	0x00,                          // country code
+	0x01,                          // one report descriptor
+	0x22, USB_CFG_HID_REPORT_DESCRIPTOR_LENGTH, 0,
+	7, USBDESCR_ENDPOINT,
+	(char)0x81, 0x03, 8, 0,        // IN 1, interrupt, 8 bytes
+	USB_CFG_INTR_POLL_INTERVAL,
+
+	9, USBDESCR_INTERFACE,
+	UCD_RAW_INTERFACE, 0,
+	1,                             // endpoints
+	0xFF, 0x00, 0x00,              // vendor class, no driver binds
+	0,
+	7, USBDESCR_ENDPOINT,
+	(char)UCD_RAW_ENDPOINT, 0x03, 8, 0,
+	USB_CFG_INTR_POLL_INTERVAL,
 };
+CASSERT(sizeof(usbDescriptorConfiguration) == USB_PROP_LENGTH(USB_CFG_DESCR_PROPS_CONFIGURATION));
+CASSERT(UCD_RAW_ENDPOINT == (0x80 | USB_CFG_EP3_NUMBER));
+CASSERT(UCD_RAW_FLAG_OVERFLOW == SAMPLER_RANGE_OVERFLOW && UCD_RAW_FLAG_UNDERFLOW == SAMPLER_RANGE_UNDERFLOW);
+#endif
 
 ucd_calibration_request_type ee_calibration[8] EEMEM;
 
+/* interrupt packets are polled once per interval, a report takes one or more */
+#if WITH_HID_SENSOR
+#define REPORT_SIZE sizeof(ucd_sensor_input_report_type)
+#define REPORT_SAMPLES 1
+#else
+#define REPORT_SIZE sizeof(ucd_input_report_type)
+#define REPORT_SAMPLES UCD_INPUT_BATCH_SIZE
+#endif
+#define REPORT_MAX_RATE \
+	( REPORT_SAMPLES * 1000 / (USB_CFG_INTR_POLL_INTERVAL * ((REPORT_SIZE + 7) / 8)) )
+
+static const ucd_caps_request_type caps PROGMEM = {
+	.version = UCD_PROTOCOL_VERSION,
+#if WITH_HID_SENSOR
+	.formats = UCD_FORMAT_HID_SENSOR,
+	.features = UCD_FEATURE_VENDOR_RQ
+#else
+#if SAMPLER_CHANNELS > 1
+	.formats = UCD_FORMAT_CHANNELS,
+#else
+	.formats = UCD_FORMAT_BATCH,
+#endif
+	.features = UCD_FEATURE_VENDOR_RQ | UCD_FEATURE_EVENT_MODE
+#endif
+#if WITH_HISTORY
+		| UCD_FEATURE_HISTORY
+#endif
+#if WITH_STATS
+		| UCD_FEATURE_STATS
+#endif
+#if WITH_PROFILE
+		| UCD_FEATURE_PROFILE
+#endif
+#if WITH_RAW_STREAM
+		| UCD_FEATURE_RAW_STREAM
+#endif
+	,
+	.max_rate = REPORT_MAX_RATE,
+#if WITH_HISTORY
+	.history_size = UCD_HISTORY_SIZE,
+#endif
+	.batch_size = REPORT_SAMPLES,
+	.channels = SAMPLER_CHANNELS,
+};
+
+/*
+ * Timer part
+ */
+ISR(TIM0_COMPA_vect, ISR_NOBLOCK)
+{
+	++g_ticks;
+}
+
+static void tick_init(void)
+{
+	TCCR0A = _BV(WGM01); // wgm=2, CTC mode
+	OCR0A = TICK_OCR;
+	TCCR0B = TICK_CS;
+	TIMSK |= _BV(OCIE0A);
+}
+
+static uint16_t tick_now(void)
+{
+	uint16_t now;
+	ATOMIC_BLOCK(ATOMIC_RESTORESTATE)
+	{
+		now = g_ticks;
+	}
+	return now;
+}
+
+#if WITH_STATS || WITH_PROFILE
+/* low byte of ms tick in high byte, timer0 count in low byte */
+static uint16_t tick_fine(void)
+{
+	uint8_t ms, counts;
+	ATOMIC_BLOCK(ATOMIC_RESTORESTATE)
+	{
+		ms = g_ticks;
+		counts = TCNT0;
+		/* timer has just wrapped, the tick is not counted yet */
+		if ( (TIFR & _BV(OCF0A)) && counts < TICK_OCR/2 )
+			++ms;
+	}
+	return (uint16_t)ms << 8 | counts;
+}
+
+/* time between two fine ticks, in the same ms << 8 | counts form */
+static uint16_t tick_elapsed(uint16_t mark, uint16_t t)
+{
+	uint8_t ms = (t >> 8) - (mark >> 8);
+	uint8_t counts = (uint8_t)t - (uint8_t)mark;
+	if ( (uint8_t)t < (uint8_t)mark )
+	{
+		--ms;
+		counts += TICK_OCR + 1;
+	}
+	return (uint16_t)ms << 8 | counts;
+}
+#endif
+
+#if WITH_STATS
+static void stats_loop_update(void)
+{
+	/* main loop iteration time */
+	const uint16_t t = tick_fine();
+	const uint16_t elapsed = tick_elapsed(stats.loop_mark, t);
+	if ( elapsed > stats.max_loop )
+		stats.max_loop = elapsed;
+	stats.loop_mark = t;
+
+	/* samples during the last second */
+	const uint16_t now = tick_now();
+	if ( (uint16_t)(now - stats.rate_stamp) >= 1000 )
+	{
+		stats.rate_stamp = now;
+		stats.sample_rate = g_sampler_stats.samples - stats.rate_mark;
+		stats.rate_mark = g_sampler_stats.samples;
+	}
+}
+#endif
+
+#if WITH_PROFILE
+/*
+ * Stage profiling: wall time in timer0 counts, interrupts included
+ */
+static void profile_add(uint8_t stage, uint16_t runs, uint16_t total, uint16_t min, uint16_t max)
+{
+	profile_stage_type * const st = &profile[stage];
+	if ( !runs || st->runs > 0xFFFF - runs )
+		return; /* keep total and runs consistent, stop when runs saturate */
+	if ( profile_prescaler && profile_prescaler != sampler_get_prescaler() )
+		return;
+	if ( !st->runs || min < st->min )
+		st->min = min;
+	if ( max > st->max )
+		st->max = max;
+	st->runs += runs;
+	st->total += total;
+}
+
+static void profile_stop(uint8_t stage, uint16_t mark)
+{
+	const uint16_t elapsed = tick_elapsed(mark, tick_fine());
+	const uint16_t counts = (elapsed >> 8) * (TICK_OCR + 1) + (uint8_t)elapsed;
+	profile_add(stage, 1, counts, counts, counts);
+}
+
+static void profile_isr_clear(profile_isr_type *p)
+{
+	p->runs = 0;
+	p->min = 0xFF;
+	p->max = 0;
+	p->total = 0;
+}
+
+/* move what the sampler ISRs have gathered into their stages */
+static void profile_isr_fold(void)
+{
+	for(uint8_t i = 0; i != PROFILE_ISR_COUNT; ++i)
+	{
+		profile_isr_type p;
+		ATOMIC_BLOCK(ATOMIC_RESTORESTATE)
+		{
+			p = g_profile_isr[i];
+			profile_isr_clear(&g_profile_isr[i]);
+		}
+		profile_add(UCD_PROFILE_CAPTURE_ISR + i, p.runs, p.total, p.min, p.max);
+	}
+}
+
+static void profile_reset(void)
+{
+	memset(profile, 0, sizeof(profile));
+	ATOMIC_BLOCK(ATOMIC_RESTORESTATE)
+	{
+		for(uint8_t i = 0; i != PROFILE_ISR_COUNT; ++i)
+			profile_isr_clear(&g_profile_isr[i]);
+	}
+}
+
+#define PROFILE(stage, stmt) do {				\
+		const uint16_t profile_mark__ = tick_fine();	\
+		stmt;						\
+		profile_stop(stage, profile_mark__);		\
+	} while(0)
+#else
+#define PROFILE(stage, stmt) stmt
+#endif
+
+/*
+ * Configuration and warm start
+ */
+static uint8_t config_check(void)
+{
+	uint8_t sum = CONFIG_CHECK_SEED;
+	const uint8_t *p = (const uint8_t *)&g_config.parameters;
+	for(uint8_t i = 0; i != sizeof(g_config.parameters); ++i)
+		sum += p[i];
+	return sum;
+}
+
+static void config_changed(void)
+{
+	g_config.check = config_check();
+	config_pending = sizeof(g_config); /* (re)start the copy */
+}
+
+/* decide if RAM state survived the reset, reload it otherwise */
+static uint8_t warm_start_check(void)
+{
+	/* power-on and brown-out leave RAM undefined */
+	if ( !(mcusr_mirror & (_BV(PORF) | _BV(BORF)))
+	     && WARM_MAGIC == warm_magic
+	     && config_check() == g_config.check
+	     && (uint16_t)~filtered_value == filtered_check )
+		return 1;
+
+	eeprom_read_block(&g_config, &ee_config, sizeof(g_config));
+	if ( config_check() != g_config.check )
+	{
+		memset(&g_config.parameters, 0, sizeof(g_config.parameters));
+		g_config.parameters.report_interval = DEFAULT_REPORT_INTERVAL;
+		g_config.check = config_check();
+	}
+	filtered_value = 0;
+	filtered_check = ~0;
+	warm_magic = WARM_MAGIC;
+	return 0;
+}
+
 /*
  * USB part
  */
@@ -99,7 +503,7 @@ void sensor_read_feature_data(uint8_t id)
 	switch ( id )
 	{
 	case UCD_SUBRQ_PARAMETERS:
-		memcpy(feature_report + 1, &g_parameters, sizeof(ucd_parameters_request_type));
+		memcpy(feature_report + 1, &g_config.parameters, sizeof(ucd_parameters_request_type));
 		break;
 	break;
 	case UCD_SUBRQ_CALIBRATION_SET_0:
@@ -114,15 +518,67 @@ void sensor_read_feature_data(uint8_t id)
 				  &ee_calibration[id - UCD_SUBRQ_CALIBRATION_SET_0],
 				  sizeof(ucd_calibration_request_type));
 		break;
+#if WITH_STATS
+	case UCD_SUBRQ_STATS:
+	{
+		ucd_stats_request_type * const st = (void *)(feature_report + 1);
+		st->samples = g_sampler_stats.samples;
+		st->sample_rate = stats.sample_rate;
+		st->overflows = g_sampler_stats.overflows;
+		st->underflows = g_sampler_stats.underflows;
+		st->reports = stats.reports;
+		st->max_loop = stats.max_loop;
+		st->tick_counts = TICK_OCR + 1;
+		st->eeprom_pending = eeprom_transfer.count + config_pending;
+		st->reset_cause = mcusr_mirror | (warm_started ? UCD_RESET_WARM : 0);
+		break;
+	}
+	case UCD_SUBRQ_PRESCALER_HITS:
+		memcpy(feature_report + 1, g_sampler_stats.prescaler_hits, SAMPLER_PRESCALER_COUNT);
+		break;
+#endif
+	case UCD_SUBRQ_CAPS:
+		memcpy_P(feature_report + 1, &caps, sizeof(caps));
+		break;
+	default:
+		/* unknown subrequest reads as zeroes */
+		memset(feature_report + 1, 0, UCD_FEATURE_REPORT_COUNT);
+#if WITH_PROFILE
+		if ( (uint8_t)(id - UCD_SUBRQ_PROFILE_0) < UCD_PROFILE_STAGES )
+		{
+			ucd_profile_request_type * const pr = (void *)(feature_report + 1);
+			memcpy(pr, &profile[id - UCD_SUBRQ_PROFILE_0], sizeof(profile_stage_type));
+			pr->count_cycles = TICK_DIVIDER;
+			pr->prescaler = profile_prescaler;
+		}
+#endif
+		break;
 	}
 }
 
+#if WITH_HID_SENSOR
+void sensor_write_feature_report(void)
+{
+	memcpy(&sensor_feature, feature_report, sizeof(sensor_feature));
+	if ( sensor_feature.report_interval > 0xFFFF )
+		sensor_feature.report_interval = 0xFFFF;
+	/* hid-sensor-als sets the feature on every read, most sets change nothing */
+	if ( g_config.parameters.report_interval == sensor_feature.report_interval )
+		return;
+	g_config.parameters.report_interval = sensor_feature.report_interval;
+	config_changed();
+}
+#endif
+
 void sensor_write_feature_data(uint8_t id)
 {
 	switch ( id )
 	{
 	case UCD_SUBRQ_PARAMETERS:
-		memcpy(&g_parameters, feature_report + 1, sizeof(ucd_parameters_request_type));
+		if ( !memcmp(&g_config.parameters, feature_report + 1, sizeof(ucd_parameters_request_type)) )
+			break;
+		memcpy(&g_config.parameters, feature_report + 1, sizeof(ucd_parameters_request_type));
+		config_changed();
 		break;
 	case UCD_SUBRQ_CALIBRATION_SET_0:
 	case UCD_SUBRQ_CALIBRATION_SET_1:
@@ -139,6 +595,22 @@ void sensor_write_feature_data(uint8_t id)
 		eeprom_transfer.src = feature_report + 1;
 		eeprom_transfer.count = sizeof(ucd_calibration_request_type);
 		break;
+#if WITH_STATS
+	case UCD_SUBRQ_STATS:
+		stats.max_loop = 0;
+		memset(g_sampler_stats.prescaler_hits, 0, SAMPLER_PRESCALER_COUNT);
+		break;
+#endif
+#if WITH_PROFILE
+	default:
+		if ( (uint8_t)(id - UCD_SUBRQ_PROFILE_0) < UCD_PROFILE_STAGES )
+		{
+			const ucd_profile_request_type * const pr = (void *)(feature_report + 1);
+			profile_prescaler = pr->prescaler & 0x0F;
+			profile_reset();
+		}
+		break;
+#endif
 	}
 }
 
@@ -148,6 +620,10 @@ USB_PUBLIC usbMsgLen_t usbFunctionSetup(uchar data[8])
 	const uint8_t report_type = rq->wValue.bytes[1]; /* wValue: ReportType (highbyte) */
 	const uint8_t report_id = rq->wValue.bytes[0]; /* ReportID (lowbyte) */
 
+#if WITH_HISTORY
+	history_freeze(0); /* in case the host has aborted history read */
+#endif
+
 	switch ( rq->bmRequestType & USBRQ_TYPE_MASK )
 	{
 	case USBRQ_TYPE_CLASS:
@@ -157,11 +633,25 @@ USB_PUBLIC usbMsgLen_t usbFunctionSetup(uchar data[8])
 			switch ( report_type ) 
 			{
 			case USBRQ_HID_REPORT_TYPE_INPUT:
-				usbMsgPtr = (void *)&input_report;
+#if WITH_HID_SENSOR
+				usbMsgPtr = (void *)&sensor_input;
+				return sizeof(sensor_input);
+#else
+				/* prefer fresh samples, the host drops duplicates by seq */
+				usbMsgPtr = (void *)( input_report.count ? &input_report : &report_tx );
 				return sizeof(input_report);
+#endif
 			case USBRQ_HID_REPORT_TYPE_FEATURE:
 				feature_report[0] = report_id;
 				usbMsgPtr = (void*)&feature_report;
+#if WITH_HID_SENSOR
+				if ( UCD_SENSOR_REPORT_ID == report_id )
+				{
+					sensor_feature.report_interval = g_config.parameters.report_interval;
+					usbMsgPtr = (void *)&sensor_feature;
+					return sizeof(sensor_feature);
+				}
+#else
 				if ( UCD_SUBRQ_MUX_REPORT_ID == report_id )
 				{
 					feature_report[1] = active_subrq_mux;
@@ -172,6 +662,16 @@ USB_PUBLIC usbMsgLen_t usbFunctionSetup(uchar data[8])
 					sensor_read_feature_data(active_subrq_mux);
 					return sizeof(feature_report);
 				}
+#endif
+#if WITH_HISTORY
+				if ( UCD_SUBRQ_HISTORY_REPORT_ID == report_id )
+				{
+					/* streamed by usbFunctionRead, keep the ring still meanwhile */
+					history_freeze(1);
+					usb_transfer.count = 0;
+					return USB_NO_MSG;
+				}
+#endif
 				break;
 			}
 			break;
@@ -183,7 +683,21 @@ USB_PUBLIC usbMsgLen_t usbFunctionSetup(uchar data[8])
 			break;
 		}
 		break;
-	default: /* no vendor specific requests implemented */
+	case USBRQ_TYPE_VENDOR:
+		switch ( rq->bRequest )
+		{
+		case UCD_VENDOR_RQ_GET:
+			sensor_read_feature_data(rq->wValue.bytes[0]);
+			usbMsgPtr = (void *)&feature_report[1];
+			return UCD_FEATURE_REPORT_COUNT;
+		case UCD_VENDOR_RQ_SET:
+			/* data goes after report id 0, which stands for vendor request */
+			feature_report[0] = 0;
+			vendor_subrq = rq->wValue.bytes[0];
+			usb_transfer.count = 1;
+			usb_transfer.max = min( rq->wLength.bytes[0] + 1, sizeof(feature_report) );
+			return USB_NO_MSG;
+		}
 		break;
 	}
 	/* default for not implemented requests: return no data back to host */
@@ -203,6 +717,12 @@ USB_PUBLIC uchar usbFunctionWrite(uchar *data, uchar len)
 		return 0; /* transfer still incomplete, more data expected */
 
 	const uint8_t report_id = feature_report[0];
+#if WITH_HID_SENSOR
+	if ( UCD_SENSOR_REPORT_ID == report_id )
+	{
+		sensor_write_feature_report();
+	}
+#else
 	if ( UCD_SUBRQ_MUX_REPORT_ID == report_id )
 	{
 		ucd_mux_request_type *rq = (ucd_mux_request_type *)(feature_report+1);
@@ -212,10 +732,200 @@ USB_PUBLIC uchar usbFunctionWrite(uchar *data, uchar len)
 	{
 		sensor_write_feature_data(active_subrq_mux);
 	}
+#endif
+	if ( 0 == report_id )
+	{
+		sensor_write_feature_data(vendor_subrq);
+	}
 	return 1;
 }
 
+#if WITH_HISTORY
+USB_PUBLIC uchar usbFunctionRead(uchar *data, uchar len)
+{
+	/* report id goes first, then the history itself */
+	uint8_t count = 0;
+	if ( !usb_transfer.count )
+	{
+		data[count++] = UCD_SUBRQ_HISTORY_REPORT_ID;
+		usb_transfer.count = 1;
+	}
+	const uint8_t n = history_read(usb_transfer.count - 1, data + count, len - count);
+	usb_transfer.count += n;
+	count += n;
+	if ( count < len || usb_transfer.count == 1 + sizeof(ucd_history_report_type) )
+		history_freeze(0); /* transfer complete */
+	return count;
+}
+#endif
 
+#if WITH_HID_SENSOR
+/*
+ * HID Sensor input: the newest sample is sent when it has moved
+ * by sensitivity since the last one sent, no sooner than report interval
+ */
+static void sensor_input_update(uint16_t value)
+{
+	sensor_input.illuminance = value;
+	sensor_pending = 1;
+}
+
+static void sensor_input_send(void)
+{
+	if ( !sensor_pending || !usbInterruptIsReady() )
+		return;
+	if ( UCD_SENSOR_REPORTING_ALL_EVENTS != sensor_feature.reporting_state
+	     || UCD_SENSOR_POWER_D0 != sensor_feature.power_state )
+		return;
+
+	const uint16_t value = sensor_input.illuminance;
+	const uint16_t delta = value > sensor_last ? value - sensor_last : sensor_last - value;
+	if ( delta < sensor_feature.sensitivity )
+		return;
+
+	const uint16_t now = tick_now();
+	if ( (uint16_t)(now - report_stamp) < g_config.parameters.report_interval )
+		return;
+	report_stamp = now;
+
+	sensor_last = value;
+	sensor_pending = 0;
+#if WITH_STATS
+	++stats.reports;
+#endif
+	usbSetInterrupt((void *)&sensor_input, sizeof(sensor_input));
+}
+
+#else
+/*
+ * Event mode: pass only values which moved away from the last reported one
+ * by more than the relative hysteresis, or when keepalive time expires
+ */
+static uint8_t input_event_due(uint16_t value)
+{
+	if ( !(g_config.parameters.flags & UCD_PARAM_FLAG_EVENT_MODE) )
+		return 1;
+
+	const uint16_t now = tick_now();
+	const uint16_t delta = value > event_value ? value - event_value : event_value - value;
+	if ( delta <= (event_value >> (g_config.parameters.hysteresis_shift & 0x0F))
+	     && ( !g_config.parameters.keepalive
+		  || (uint16_t)(now - event_stamp) < g_config.parameters.keepalive ) )
+		return 0;
+
+	event_value = value;
+	event_stamp = now;
+	return 1;
+}
+
+/*
+ * Input report batching
+ */
+static void input_report_put(uint8_t n, uint16_t value, uint8_t prescaler, uint16_t stamp)
+{
+	input_report.sample[n] = value;
+	input_report.stamp[n] = stamp;
+	uint8_t *ps = &input_report.prescaler[n>>1];
+	if ( n & 1 )
+		*ps |= prescaler << 4;
+	else
+		*ps = prescaler;
+}
+
+#if SAMPLER_CHANNELS > 1
+/*
+ * Multi-channel: a report is one round over the channels,
+ * it becomes visible when the last channel is in
+ */
+static void input_frame_update(uint8_t channel, uint16_t value, uint8_t prescaler, uint16_t stamp)
+{
+	if ( !channel && input_report.count )
+	{
+		/* host did not collect the last round in time, drop it */
+		input_report.seq += input_report.count;
+		input_report.count = 0;
+	}
+	input_report_put(channel, value, prescaler, stamp);
+	if ( SAMPLER_CHANNELS - 1 == channel && input_event_due(input_report.sample[0]) )
+		input_report.count = SAMPLER_CHANNELS;
+}
+#else
+static void input_report_append(uint16_t value, uint8_t prescaler, uint16_t stamp)
+{
+	uint8_t n = input_report.count;
+	if ( UCD_INPUT_BATCH_SIZE == n )
+	{
+		/* host did not collect the batch in time, drop it.
+		 * the host sees the gap in seq */
+		input_report.seq += n;
+		n = 0;
+	}
+	input_report_put(n, value, prescaler, stamp);
+	input_report.count = n + 1;
+}
+#endif
+
+static void input_report_send(void)
+{
+	if ( !usbInterruptIsReady() )
+		return;
+
+	if ( !intr_transfer.count )
+	{
+		if ( !input_report.count )
+			return; /* nothing new to report */
+
+		/* refill at the rate requested by host */
+		const uint16_t now = tick_now();
+		if ( (uint16_t)(now - report_stamp) < g_config.parameters.report_interval )
+			return;
+		report_stamp = now;
+
+		/* move the batch to transmit buffer and start a new one */
+		report_tx = input_report;
+		input_report.seq += input_report.count;
+		input_report.count = 0;
+#if WITH_STATS
+		++stats.reports;
+#endif
+		intr_transfer.ptr = (uint8_t*)&report_tx;
+		intr_transfer.count = sizeof(report_tx);
+	}
+
+	/* low speed interrupt packets are 8 bytes max,
+	 * a short packet terminates the report */
+	const uint8_t len = min(intr_transfer.count, 8);
+	usbSetInterrupt(intr_transfer.ptr, len);
+	intr_transfer.ptr += len;
+	intr_transfer.count -= len;
+}
+#endif /* WITH_HID_SENSOR */
+
+#if WITH_RAW_STREAM
+/*
+ * Raw captures go out on endpoint 3 whenever a host collects them,
+ * endpoint 1 does not wait for it
+ */
+static void raw_capture_update(void)
+{
+	++raw_capture.seq;
+	raw_capture.prescaler = sampler_get_prescaler();
+	raw_capture.value = sampler_get_raw();
+	raw_capture.flags = sampler_get_range_flags() | sampler_get_channel() << 4;
+	raw_capture.stamp = tick_now();
+	raw_capture.filtered = filtered_value;
+	raw_pending = 1;
+}
+
+static void raw_capture_send(void)
+{
+	if ( raw_pending && usbInterruptIsReady3() )
+	{
+		usbSetInterrupt3((uchar *)&raw_capture, sizeof(raw_capture));
+		raw_pending = 0;
+	}
+}
+#endif
 
 /*
  * Initialization and entry point
@@ -224,57 +934,258 @@ USB_PUBLIC uchar usbFunctionWrite(uchar *data, uchar len)
 INIT_FUNC_3 void early_init(void)
 {
 	mcusr_mirror = MCUSR;
+	MCUSR = 0; /* next reset reports its own cause only */
 	wdt_disable();
 }
 
 INIT_FUNC_8 void late_init(void)
 {
+	warm_started = warm_start_check();
+#if WITH_OSCCAL
+	osccal_init();
+#endif
 	usbInit();
-	sampler_init();
+	tick_init();
+	sampler_init(warm_started);
+#if WITH_PROFILE
+	profile_reset();
+#endif
+#if WITH_SUSPEND
+	PCMSK |= _BV(USB_CFG_DMINUS_BIT); /* flag D- changes, interrupt only while suspended */
+#endif
+}
+
+#if SAMPLER_CHANNELS > 1
+/* IR rejection: channel 1 sees what channel 0 should not */
+static uint16_t channel_compensated(void)
+{
+	const uint16_t ir = ((uint32_t)channel_value[1] * g_config.parameters.ir_weight) >> 8;
+	return channel_value[0] > ir ? channel_value[0] - ir : 0;
+}
+#endif
+
+/*
+ * Sample processing, same for normal operation and suspend
+ */
+static void sample_process(void)
+{
+	const uint16_t fp_sample = sampler_get_sample();
+	uint16_t sample;
+	PROFILE(UCD_PROFILE_FP_INVERSE,
+		sample = fp_to_uint16(
+			fp_inverse(
+				fp_sample,
+				g_config.parameters.sensitivity + HARD_SENSITIVITY_OFFSET)
+			));
+	/* filter values: report = 15/16 * sample + 1/16 * report */
+	const uint8_t filter_strength = 1;
+#if SAMPLER_CHANNELS > 1
+	const uint8_t channel = sampler_get_channel();
+	uint16_t filtered = channel_value[channel];
+	PROFILE(UCD_PROFILE_FILTER,
+		filtered = sample - (sample>>filter_strength) + (filtered>>filter_strength));
+	channel_value[channel] = filtered;
+	filtered_value = channel_compensated();
+#else
+	PROFILE(UCD_PROFILE_FILTER,
+		filtered_value = sample - (sample>>filter_strength) + (filtered_value>>filter_strength));
+#endif
+	filtered_check = ~filtered_value;
+#if WITH_RAW_STREAM
+	raw_capture_update();
+#endif
+#if WITH_HID_SENSOR
+	sensor_input_update(filtered_value);
+#elif SAMPLER_CHANNELS > 1
+	input_frame_update(channel, channel ? filtered : filtered_value,
+			   sampler_get_prescaler(), tick_now());
+#else
+	if ( input_event_due(filtered_value) )
+		input_report_append(filtered_value, sampler_get_prescaler(), tick_now());
+#endif
+}
+
+#if WITH_HISTORY
+static void history_tick(void)
+{
+	/* record history at fixed rate, once there is something to record */
+	if ( filtered_value
+	     && (uint16_t)(tick_now() - history_stamp) >= UCD_HISTORY_PERIOD )
+	{
+		history_stamp += UCD_HISTORY_PERIOD;
+		history_append(filtered_value);
+	}
+}
+#endif
+
+#if WITH_SUSPEND
+/*
+ * Suspend: the bus has gone quiet, sample at a low rate in power-down
+ * and keep the ranging and the filter warm for the resume
+ */
+EMPTY_INTERRUPT(WDT_vect);
+
+ISR(PCINT0_vect)
+{
+	bus_resumed = 1;
+}
+
+/* power down until the watchdog or the bus wakes us up */
+static void suspend_sleep(void)
+{
+	uint16_t slept = 0;
+
+	wdt_reset();
+	WDTCR = _BV(WDCE) | _BV(WDE);
+	WDTCR = _BV(WDIE) | _BV(WDP0); /* interrupt only, 32ms */
+	set_sleep_mode(SLEEP_MODE_PWR_DOWN);
+
+	/* the period in steps: a resume ends it part way into one, the
+	 * elapsed time is then known to half a step */
+	cli();
+	while ( !bus_resumed && slept < SUSPEND_PERIOD )
+	{
+		/* sei takes effect after sleep, no wake up is missed */
+		sleep_enable();
+		sei();
+		sleep_cpu();
+		sleep_disable();
+		cli();
+		slept += bus_resumed ? SUSPEND_STEP/2 : SUSPEND_STEP;
+	}
+	sei();
+	wdt_disable();
+
+	/* timer0 is stopped in power-down, keep the ms tick roughly right */
+	ATOMIC_BLOCK(ATOMIC_RESTORESTATE)
+	{
+		g_ticks += slept;
+	}
+}
+
+static void suspend(void)
+{
+	bus_resumed = 0;
+	GIFR = _BV(PCIF);
+	GIMSK |= _BV(PCIE);
+
+	for(;;)
+	{
+		/* complete the capture in progress, timer1 needs the clock */
+		set_sleep_mode(SLEEP_MODE_IDLE);
+		while ( !sampler_poll() )
+		{
+			if ( bus_resumed )
+				goto resumed; /* main loop picks the capture up */
+			sleep_mode();
+		}
+		sample_process();
+#if WITH_HISTORY
+		history_tick();
+#endif
+		suspend_sleep();
+		sampler_start();
+		if ( bus_resumed )
+			break;
+	}
+
+resumed:
+	GIMSK &= ~_BV(PCIE);
+	bus_stamp = tick_now();
+#if WITH_STATS
+	stats.loop_mark = tick_fine(); /* suspend is not a slow iteration */
+#endif
 }
 
+static void suspend_poll(void)
+{
+	/* keep-alives and packets toggle D- */
+	if ( GIFR & _BV(PCIF) )
+	{
+		GIFR = _BV(PCIF);
+		bus_stamp = tick_now();
+		return;
+	}
+	/* let calibration data and parameters reach the EEPROM first */
+	if ( eeprom_transfer.count || config_pending )
+		return;
+	if ( (uint16_t)(tick_now() - bus_stamp) > SUSPEND_TIMEOUT )
+		suspend();
+}
+#endif
+
 #if defined(__GNUC__) && defined(__AVR__)
 int main(void) __attribute__((OS_main));
 #endif
 int main(void)
 {
 	usbDeviceDisconnect();
-	_delay_ms(250);
-	usbDeviceConnect();
-
 	sei();
 
+	/* range and filter while the host notices the disconnect */
+	const uint16_t connect_stamp = tick_now();
 	sampler_start();
+	while ( (uint16_t)(tick_now() - connect_stamp) < CONNECT_DELAY )
+	{
+		if ( sampler_poll() )
+		{
+			sample_process();
+			sampler_start();
+		}
+	}
+	usbDeviceConnect();
+#if WITH_STATS
+	stats.loop_mark = tick_fine();
+#endif
 	for(;;)
 	{
-		usbPoll();
-		if ( usbInterruptIsReady() )
-			usbSetInterrupt((void*)&input_report, sizeof(input_report));
+#if WITH_STATS
+		stats_loop_update();
+#endif
+#if WITH_PROFILE
+		profile_isr_fold();
+#endif
+		PROFILE(UCD_PROFILE_USB_POLL, usbPoll());
+#if WITH_HID_SENSOR
+		PROFILE(UCD_PROFILE_REPORT_SEND, sensor_input_send());
+#else
+		PROFILE(UCD_PROFILE_REPORT_SEND, input_report_send());
+#endif
+#if WITH_RAW_STREAM
+		raw_capture_send();
+#endif
 
 		/* check for sample data availability */
-		if ( sampler_poll() )
+		uint8_t sample_ready;
+		PROFILE(UCD_PROFILE_SAMPLER_POLL, sample_ready = sampler_poll());
+		if ( sample_ready )
 		{
-			const uint16_t fp_sample = sampler_get_sample();
-			const uint16_t sample = 
-				fp_to_uint16(
-					fp_inverse(
-						fp_sample,
-						g_parameters.sensitivity + HARD_SENSITIVITY_OFFSET)
-					);
-			/* filter values: report = 15/16 * sample + 1/16 * input_report */
-			const uint8_t filter_strength = 1;
-			input_report = sample - (sample>>filter_strength) + (input_report>>filter_strength);
+			sample_process();
 			sampler_start();
 		}
 
-		/* check if background eeprom write operation pending */
+#if WITH_HISTORY
+		history_tick();
+#endif
+#if WITH_SUSPEND
+		suspend_poll();
+#endif
+
+		/* check if background eeprom write operation pending,
+		 * calibration first, it has no copy of its own to wait in */
 		if ( eeprom_transfer.count )
 		{
-			eeprom_write_byte(
+			eeprom_update_byte(
 				eeprom_transfer.dst++,
 				*eeprom_transfer.src++
 				);
 			--eeprom_transfer.count;
 		}
+		else if ( config_pending )
+		{
+			/* unchanged bytes are only read, not worn */
+			const uint8_t i = sizeof(g_config) - config_pending--;
+			eeprom_update_byte((uint8_t*)&ee_config + i, ((uint8_t*)&g_config)[i]);
+		}
 	}
 }
@@ -0,0 +1,61 @@
+#include "osccal.h"
+#include "usbdrv/usbdrv.h"
+#include <avr/io.h>
+#include <avr/eeprom.h>
+#include <util/atomic.h>
+
+/* usbMeasureFrameLength() counts 7 cycle units over a 1 ms frame */
+#define FRAME_TARGET ( (F_CPU/1000 + 3) / 7 )
+
+static uint8_t ee_osccal EEMEM = 0xFF;
+
+static uint16_t
+frame_deviation(void)
+{
+	const uint16_t length = usbMeasureFrameLength();
+	return length > FRAME_TARGET ? length - FRAME_TARGET : FRAME_TARGET - length;
+}
+
+/* start from the last good value, the host resets the bus before talking */
+void
+osccal_init(void)
+{
+	const uint8_t value = eeprom_read_byte(&ee_osccal);
+	if ( value != 0xFF )
+		OSCCAL = value;
+}
+
+/* called on the end of USB reset, with the bus idle but for SOF keep-alives */
+void
+osccal_calibrate(void)
+{
+	ATOMIC_BLOCK(ATOMIC_RESTORESTATE)
+	{
+		/* binary search, the clock and the frame length grow with OSCCAL */
+		uint8_t value = 0;
+		for(uint8_t step = 0x80; step; step >>= 1)
+		{
+			OSCCAL = value + step;
+			if ( usbMeasureFrameLength() < FRAME_TARGET )
+				value += step;
+		}
+
+		/* the ranges of OSCCAL overlap, check the neighbours */
+		uint8_t best = value;
+		uint16_t best_deviation = 0xFFFF;
+		for(uint8_t trial = value ? value - 1 : 0; ; ++trial)
+		{
+			OSCCAL = trial;
+			const uint16_t deviation = frame_deviation();
+			if ( deviation < best_deviation )
+			{
+				best = trial;
+				best_deviation = deviation;
+			}
+			if ( trial == value + 1 || trial == 0xFF )
+				break;
+		}
+		OSCCAL = best;
+	}
+	eeprom_update_byte(&ee_osccal, OSCCAL);
+}
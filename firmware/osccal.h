@@ -0,0 +1,11 @@
+/**
+ *  internal RC oscillator calibration against USB frame timing
+ */
+
+#ifndef OSCCAL_H_INC
+#define OSCCAL_H_INC
+
+void osccal_init(void);
+void osccal_calibrate(void);
+
+#endif /* OSCCAL_H_INC */
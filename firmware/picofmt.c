@@ -42,6 +42,59 @@ void pfmt_crlf(void)
 	uart_putchar('\n');
 }
 
+/*
+ * Decimal output by double dabble, libgcc division is costly without MUL
+ *
+ * - buf holds bin_size bytes of binary, least significant first, and room
+ *   for the BCD digits after it
+ * - every bit shifted out of the binary into the BCD is preceded by
+ *   adding 3 to the digits that are 5 or more, the cost depends only on
+ *   the width
+ */
+#define PFMT_BCD_SIZE 5 /* 10 digits of uint32_t */
+
+static void pfmt_decimal(uint8_t *buf, uint8_t bin_size)
+{
+	uint8_t * const bcd = buf + bin_size;
+	const uint8_t bcd_size = bin_size + 1; /* 16 bits - 5 digits, 32 bits - 10 */
+	uint8_t i, bits;
+
+	for(i = 0; i != bcd_size; ++i)
+		bcd[i] = 0;
+
+	for(bits = bin_size << 3; bits; --bits)
+	{
+		for(i = 0; i != bcd_size; ++i)
+		{
+			if ( (bcd[i] & 0x0F) >= 0x05 )
+				bcd[i] += 0x03;
+			if ( (bcd[i] & 0xF0) >= 0x50 )
+				bcd[i] += 0x30;
+		}
+
+		uint8_t carry = 0;
+		for(i = 0; i != bin_size + bcd_size; ++i)
+		{
+			const uint8_t b = buf[i];
+			buf[i] = (b << 1) | carry;
+			carry = b >> 7;
+		}
+	}
+
+	/* most significant digit first, leading zeroes skipped */
+	uint8_t started = 0;
+	i = bcd_size;
+	do
+	{
+		const uint8_t b = bcd[--i];
+		const uint8_t hi = b >> 4, lo = b & 0x0F;
+		if ( started |= hi )
+			uart_putchar('0' + hi);
+		if ( (started |= lo) || !i )
+			uart_putchar('0' + lo);
+	} while ( i );
+}
+
 void pfmt_out(const prog_char *fmt)
 {
 	char ch;
@@ -49,10 +102,31 @@ void pfmt_out(const prog_char *fmt)
 	{
 		if ( ch == '$' )
 		{
+			const char kind = pgm_read_byte(fmt);
+			if ( kind == 'd' || kind == 'l' )
+				++fmt;
 			ch = pgm_read_byte(fmt++) - '0';
 			if ( ch < PICO_MAX_ARGS && ch >= 0 )
 			{
 				const uint16_t arg = g_picofmt_args[(uint8_t)ch];
+				if ( kind == 'd' || kind == 'l' )
+				{
+					uint8_t buf[sizeof(uint32_t) + PFMT_BCD_SIZE];
+					uint8_t size = sizeof(uint16_t);
+					buf[0] = arg;
+					buf[1] = arg >> 8;
+					if ( kind == 'l' )
+					{
+						const uint16_t low = ch + 1 < PICO_MAX_ARGS ? g_picofmt_args[ch + 1] : 0;
+						buf[2] = buf[0];
+						buf[3] = buf[1];
+						buf[0] = low;
+						buf[1] = low >> 8;
+						size = sizeof(uint32_t);
+					}
+					pfmt_decimal(buf, size);
+					continue;
+				}
 				const uint16_t rh = fmt_hex_byte(arg>>8);
 				uart_putchar(rh);
 				uart_putchar(rh>>8);
@@ -15,8 +15,11 @@ extern uint16_t g_picofmt_args[PICO_MAX_ARGS];
 void pfmt_crlf(void);
 
 /*
- * Output a string replacing $0..$9 with g_picofmt_args
+ * Output a string replacing directives with g_picofmt_args
  *
+ * - $N: argument N as 4 hex digits
+ * - $dN: argument N as unsigned decimal
+ * - $lN: arguments N (high) and N+1 (low) as 32-bit unsigned decimal
  */
 extern void pfmt_out(const prog_char *fmt);
 
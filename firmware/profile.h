@@ -0,0 +1,37 @@
+/**
+ *  per stage timing in timer0 counts (WITH_PROFILE)
+ */
+
+#ifndef PROFILE_H_INC
+#define PROFILE_H_INC
+
+/*
+ * sampler ISRs accumulate into a pending record,
+ * main loop folds it into the stage record.
+ * offsets are for sampler_irq.S
+ */
+#define PROFILE_ISR_CAPTURE 0
+#define PROFILE_ISR_OVERFLOW 1
+#define PROFILE_ISR_COUNT 2
+
+#define PROFILE_ISR_RUNS 0
+#define PROFILE_ISR_MIN 1
+#define PROFILE_ISR_MAX 2
+#define PROFILE_ISR_TOTAL 3
+#define PROFILE_ISR_SIZE 5
+
+#ifndef __ASSEMBLER__
+#include <stdint.h>
+
+typedef struct
+{
+	uint8_t runs;
+	uint8_t min;
+	uint8_t max;
+	uint16_t total;
+}profile_isr_type;
+
+extern profile_isr_type g_profile_isr[PROFILE_ISR_COUNT];
+#endif /* __ASSEMBLER__ */
+
+#endif /* PROFILE_H_INC */
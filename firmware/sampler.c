@@ -19,7 +19,20 @@ static const uint8_t underflow_threshold = 0x10;
 static const uint8_t overflow_threshold  = 0xF0;
 
 extern uint8_t sampler_value;
-static uint8_t s_prescaler __attribute__((section(".noinit")));
+/* each channel does its own ranging */
+static uint8_t s_prescaler[SAMPLER_CHANNELS] __attribute__((section(".noinit")));
+static uint8_t s_sample_prescaler; /* prescaler of the last completed capture */
+static uint8_t s_sample_range; /* SAMPLER_RANGE_* of the last completed capture */
+#if SAMPLER_CHANNELS > 1
+static uint8_t s_channel; /* channel being captured */
+static uint8_t s_sample_channel; /* channel of the last completed capture */
+#else
+#define s_channel 0
+#define s_sample_channel 0
+#endif
+#if WITH_STATS
+sampler_stats_type g_sampler_stats;
+#endif
 
 
 /* timer control */
@@ -61,28 +74,39 @@ timer1_enable(uint8_t prescaler)
 
 /* input pin control */
 
+static inline uint8_t
+input_pin(uint8_t channel)
+{
+	switch ( channel )
+	{
+	case 1: return _BV(PB3);
+	case 2: return _BV(PB4);
+	default: return _BV(INPUT_PIN);
+	}
+}
+
 // hard pull input pin up
 static inline void
-input_precharge_high(void)
+input_precharge_high(uint8_t pin)
 {
-	INPUT_PORT |= _BV(INPUT_PIN);
-	INPUT_DDR |= _BV(INPUT_DB);
+	INPUT_PORT |= pin;
+	INPUT_DDR |= pin;
 }
 
 // hard pull input pin down
 static inline void
-input_precharge_low(void)
+input_precharge_low(uint8_t pin)
 {
-	INPUT_PORT &= ~_BV(INPUT_PIN);
-	INPUT_DDR |= _BV(INPUT_DB);
+	INPUT_PORT &= ~pin;
+	INPUT_DDR |= pin;
 }
 
 // let input pin float
 static inline void
-input_discharge(void)
+input_discharge(uint8_t pin)
 {
-	INPUT_DDR &= ~_BV(INPUT_DB);
-	INPUT_PORT &= ~_BV(INPUT_PIN);
+	INPUT_DDR &= ~pin;
+	INPUT_PORT &= ~pin;
 }
 
 
@@ -101,6 +125,23 @@ comp_disable(void)
 	ACSR |= _BV(ACI);
 }
 
+// negative comparator input: AIN1 or an ADC mux input, ADC stays off
+static inline void
+comp_select(uint8_t channel)
+{
+#if SAMPLER_CHANNELS > 1
+	if ( channel )
+	{
+		ADMUX = ( 1 == channel ? 3 : 2 ); // ADC3 (PB3), ADC2 (PB4)
+		ADCSRB |= _BV(ACME);
+	}
+	else
+		ADCSRB &= ~_BV(ACME);
+#else
+	(void)channel;
+#endif
+}
+
 static inline void
 comp_set_mode(enum capture_mode mode)
 {
@@ -117,21 +158,24 @@ capture_stop(void)
 {
 	comp_disable();
 	timer1_disable();
-	input_precharge_high();
+	input_precharge_high(input_pin(s_channel));
 }
 
 static void
 capture_start(uint8_t speed_index)
 {
+	comp_select(s_channel);
 	comp_enable();
 	timer1_run(speed_index);
-	input_discharge();
+	input_discharge(input_pin(s_channel));
 }
 
 static void
 capture_reset(enum capture_mode mode)
 {
-	input_precharge_high();
+	/* channels not being captured stay precharged */
+	for(uint8_t ch = 0; ch != SAMPLER_CHANNELS; ++ch)
+		input_precharge_high(input_pin(ch));
 
 	comp_set_mode(mode);
 	timer1_enable(0);
@@ -139,15 +183,18 @@ capture_reset(enum capture_mode mode)
 
 /* sampler api */
 void
-sampler_init(void)
+sampler_init(uint8_t warm)
 {
-	s_prescaler = prescaler_max;
+	/* ranging on from the last prescaler beats starting from the slowest */
+	for(uint8_t ch = 0; ch != SAMPLER_CHANNELS; ++ch)
+		if ( !warm || s_prescaler[ch] < prescaler_min || s_prescaler[ch] > prescaler_max )
+			s_prescaler[ch] = prescaler_max;
 	capture_reset(capture_mode_rising);
 }
 
 void sampler_start(void)
 {
-	capture_start(s_prescaler);
+	capture_start(s_prescaler[s_channel]);
 }
 
 uint8_t  sampler_poll(void)
@@ -160,28 +207,75 @@ uint8_t  sampler_poll(void)
 	capture_stop();
 
 	/* adjust for next measurement */
-	const uint8_t ps = s_prescaler;
+	uint8_t * const prescaler = &s_prescaler[s_channel];
+	const uint8_t ps = *prescaler;
+	s_sample_prescaler = ps;
+	s_sample_range = 0;
 	if ( sampler_value >= overflow_threshold )
 	{
-		s_prescaler = ( ps >= prescaler_max ? prescaler_max : ps+1 );
+		*prescaler = ( ps >= prescaler_max ? prescaler_max : ps+1 );
+		s_sample_range = SAMPLER_RANGE_OVERFLOW;
+#if WITH_STATS
+		++g_sampler_stats.overflows;
+#endif
 	}
 	if ( sampler_value < underflow_threshold )
 	{
-		s_prescaler = ( ps <= prescaler_min ? prescaler_min : ps-1 );
+		*prescaler = ( ps <= prescaler_min ? prescaler_min : ps-1 );
+		s_sample_range = SAMPLER_RANGE_UNDERFLOW;
+#if WITH_STATS
+		++g_sampler_stats.underflows;
+#endif
+	}
+#if WITH_STATS
+	++g_sampler_stats.samples;
+	if ( 0xFF == ++g_sampler_stats.prescaler_hits[ps - prescaler_min] )
+	{
+		/* keep the proportions, drop the magnitude */
+		for(uint8_t i = 0; i != SAMPLER_PRESCALER_COUNT; ++i)
+			g_sampler_stats.prescaler_hits[i] >>= 1;
 	}
+#endif
+#if SAMPLER_CHANNELS > 1
+	/* next capture goes to the next channel */
+	s_sample_channel = s_channel;
+	if ( ++s_channel == SAMPLER_CHANNELS )
+		s_channel = 0;
+#endif
 	return 1;
 }
 
 fp16_t sampler_get_sample(void)
 {
 	/* return adjusted result based on prescaler */
-	return fp_compose(sampler_value<<8, s_prescaler - 1 );
+	return fp_compose(sampler_value<<8, s_sample_prescaler - 1 );
+}
+
+uint8_t sampler_get_prescaler(void)
+{
+	return s_sample_prescaler;
+}
+
+/* valid until the next sampler_start() */
+uint8_t sampler_get_raw(void)
+{
+	return sampler_value;
+}
+
+uint8_t sampler_get_range_flags(void)
+{
+	return s_sample_range;
+}
+
+uint8_t sampler_get_channel(void)
+{
+	return s_sample_channel;
 }
 
 fp16_t
 sampler_get_next_sample(void)
 {
-	capture_start(s_prescaler);
+	capture_start(s_prescaler[s_channel]);
 
 	while ( !sampler_poll() ) sleep_cpu();
 
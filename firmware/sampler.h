@@ -10,13 +10,49 @@
 #define INPUT_PORT PORTB
 #define INPUT_DDR  DDRB
 
+/*
+ * multi-channel: channels are captured in turn, channel 0 on AIN1 (PB1),
+ * the others through the ADC mux (ACME): channel 1 - ADC3 (PB3),
+ * channel 2 - ADC2 (PB4)
+ */
+#ifdef WITH_CHANNELS
+#define SAMPLER_CHANNELS WITH_CHANNELS
+#else
+#define SAMPLER_CHANNELS 1
+#endif
+#if SAMPLER_CHANNELS < 1 || SAMPLER_CHANNELS > 3
+#error sampler supports 1 to 3 channels
+#endif
+
 #include "fplib.h"
 
-void sampler_init(void);
+void sampler_init(uint8_t warm);
 void sampler_start(void);
 fp16_t sampler_get_next_sample(void);
 uint8_t sampler_poll(void);
 fp16_t sampler_get_sample(void);
+uint8_t sampler_get_prescaler(void);
+uint8_t sampler_get_raw(void);
+uint8_t sampler_get_range_flags(void);
+uint8_t sampler_get_channel(void);
 fp16_t sampler_get_next_sample(void);
 
+/* ranging done after the last capture */
+#define SAMPLER_RANGE_OVERFLOW 0x01
+#define SAMPLER_RANGE_UNDERFLOW 0x02
+
+#if WITH_STATS
+#define SAMPLER_PRESCALER_COUNT 15
+
+typedef struct
+{
+	uint16_t samples;
+	uint16_t overflows;
+	uint16_t underflows;
+	uint8_t prescaler_hits[SAMPLER_PRESCALER_COUNT]; /* halved on saturation */
+}sampler_stats_type;
+
+extern sampler_stats_type g_sampler_stats;
+#endif
+
 #endif /* SAMPLER_H_INC */
@@ -0,0 +1,51 @@
+/*
+ *
+ * Binary serial output of the uCandela serial build
+ *
+ */
+
+#ifndef SERIAL_API_H_INC
+#define SERIAL_API_H_INC
+
+#include "ucd_api.h"
+
+/*
+ * Frames
+ *
+ * - payload is followed by its CRC-8 (polynomial 0x07, initial value 0,
+ *   as _crc8_ccitt_update of avr-libc)
+ * - payload and CRC are COBS encoded, a zero byte ends the frame
+ * - a frame that does not decode or check is dropped as a whole, the
+ *   receiver resynchronizes at the next zero
+ */
+#define SFRAME_DELIMITER 0x00
+#define SFRAME_MAX_PAYLOAD 16
+#define SFRAME_MAX_ENCODED (SFRAME_MAX_PAYLOAD + 1 + 1 + 1) /* crc, COBS code, delimiter */
+
+/*
+ * Sample frame: one per output of the cadence
+ * - seq counts frames, the host detects lost ones by gaps in seq
+ * - prescaler and raw are of the last sample taken, raw is the timer1
+ *   count of the capture, 0xFF - timer overflow
+ * - value is the mean light level of the samples in fplib fp16_t format,
+ *   fp_to_uint32() gives the number the text output prints
+ */
+typedef struct
+{
+	uint8_t seq;
+	uint8_t prescaler;
+	uint8_t raw;
+	uint16_t value;
+}UCD_PACKED ucd_serial_sample_type;
+CASSERT(sizeof(ucd_serial_sample_type) == 5);
+
+/*
+ * Commands to the device: a letter, a decimal argument, CR or LF
+ * - out of range arguments leave the setting as it was
+ */
+#define SCMD_FREE 'F' /* free running, as fast as the line drains */
+#define SCMD_HZ 'H' /* n outputs per second, 1..100 */
+#define SCMD_TICKS 'T' /* an output every n ticks of 10 ms, 1..255 */
+#define SCMD_AVERAGE 'A' /* mean of n samples per output, rounded down to a power of two, 1..128 */
+
+#endif /* SERIAL_API_H_INC */
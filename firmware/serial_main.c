@@ -2,42 +2,170 @@
 #include "sampler.h"
 #include "picofmt.h"
 #include "uart.h"
+#include "sframe.h"
+#include "serial_api.h"
+#include "uart_config.h"
 
 #include <avr/io.h>
 #include <avr/wdt.h>
 #include <avr/sleep.h>
 #include <avr/interrupt.h>
 
-#define BAUDRATE_38400 99
-#define HZ_100
+/*
+ * Output format
+ * - OUTPUT_TEXT: a picofmt line per output, every tick by default
+ * - OUTPUT_FRAMES: a serial_api.h frame per output, free running by
+ *   default: as fast as the line drains
+ */
+#define OUTPUT_FRAMES
 
-volatile uint16_t g_ticks NOINIT;
-ISR(TIM0_COMPA_vect)
+/* timer0 clocks the transmitter, the tick is divided from its bit rate */
+void tick_wait(void)
 {
-	++g_ticks;
+	const uint8_t tck = uart_ticks;
+	while ( tck == uart_ticks )
+		sleep_cpu();
 }
 
-void tick_init(void)
+/*
+ * Cadence, changed at runtime by commands on the serial line
+ * - CADENCE_FREE: next output as soon as the previous one is queued
+ * - CADENCE_HZ: rate outputs per second, up to UART_TICK_HZ, the ticks
+ *   to sample at are picked by a phase accumulator
+ * - CADENCE_TICKS: an output every rate ticks
+ * - an output is the mean of 1 << average_shift samples taken back to back
+ */
+#define CADENCE_FREE 0
+#define CADENCE_HZ 1
+#define CADENCE_TICKS 2
+#define CADENCE_MAX_AVERAGE_SHIFT 7
+
+#if UART_TICK_HZ > 127
+#error phase accumulator of CADENCE_HZ holds up to 2*UART_TICK_HZ
+#endif
+
+static struct
 {
-	g_ticks = 0;
-	TCCR0A = _BV(WGM01); // wgm=2, CTC mode
-#if defined HZ_100
-	OCR0A = 117;
-	TCCR0B = _BV(CS02) | _BV(CS00); // div-by-1024
-#elif defined HZ_1000
-	OCR0A = 175;
-	TCCR0B = _BV(CS01) | _BV(CS00); // div-by-64
+	uint8_t mode;
+	uint8_t rate;
+	uint8_t phase;
+	uint8_t average_shift;
+} s_cadence = {
+#if defined OUTPUT_TEXT
+	.mode = CADENCE_TICKS,
+	.rate = 1,
 #else
-#error no HZ_XXX defined
+	.mode = CADENCE_FREE,
 #endif
-	TIMSK = _BV(OCIE0A);
+};
+
+/* commands of serial_api.h */
+static void command_run(uint8_t cmd, uint16_t arg)
+{
+	switch ( cmd )
+	{
+	case SCMD_FREE:
+		s_cadence.mode = CADENCE_FREE;
+		break;
+	case SCMD_HZ:
+		if ( arg && arg <= UART_TICK_HZ )
+		{
+			s_cadence.mode = CADENCE_HZ;
+			s_cadence.rate = arg;
+			s_cadence.phase = 0;
+		}
+		break;
+	case SCMD_TICKS:
+		if ( arg && arg <= 0xFF )
+		{
+			s_cadence.mode = CADENCE_TICKS;
+			s_cadence.rate = arg;
+		}
+		break;
+	case SCMD_AVERAGE:
+	{
+		uint8_t shift = 0;
+		while ( shift != CADENCE_MAX_AVERAGE_SHIFT && (2U << shift) <= arg )
+			++shift;
+		s_cadence.average_shift = shift;
+		break;
+	}
+	}
 }
 
-void tick_wait(void)
+static void command_poll(void)
 {
-	const uint8_t tck = g_ticks;
-	while ( tck == g_ticks )
-		sleep_cpu();
+	static uint8_t s_cmd;
+	static uint16_t s_arg;
+	int ch;
+
+	while ( (ch = uart_getchar()) >= 0 )
+	{
+		if ( ch >= '0' && ch <= '9' )
+			s_arg = (s_arg << 3) + (s_arg << 1) + (ch - '0');
+		else if ( ch == '\r' || ch == '\n' )
+		{
+			command_run(s_cmd, s_arg);
+			s_cmd = 0;
+		}
+		else
+		{
+			s_cmd = ch;
+			s_arg = 0;
+		}
+	}
+}
+
+static void cadence_wait(void)
+{
+	uint8_t n;
+
+	switch ( s_cadence.mode )
+	{
+	case CADENCE_HZ:
+		do
+		{
+			tick_wait();
+			command_poll();
+			s_cadence.phase += s_cadence.rate;
+		} while ( s_cadence.phase < UART_TICK_HZ );
+		s_cadence.phase -= UART_TICK_HZ;
+		break;
+	case CADENCE_TICKS:
+		for(n = s_cadence.rate; n; --n)
+		{
+			tick_wait();
+			command_poll();
+		}
+		break;
+	default:
+		command_poll();
+		break;
+	}
+}
+
+/* mean light level of the samples of one output, as fp_to_uint32() */
+static uint32_t cadence_measure(void)
+{
+	const uint8_t shift = s_cadence.average_shift;
+	uint8_t n = 1 << shift;
+	uint32_t sum = 0;
+
+	do
+	{
+		fp16_t sample;
+
+		/* a byte received meanwhile held off the capture interrupt */
+		do
+		{
+			UART_STATE &= ~_BV(UART_RX_SEEN_BIT);
+			sample = sampler_get_next_sample();
+		} while ( UART_STATE & _BV(UART_RX_SEEN_BIT) );
+
+		const fp16_t level = fp_inverse(sample, 0);
+		sum += fp_to_uint32(level) >> shift;
+	} while ( --n );
+	return sum;
 }
 
 static NOINIT uint8_t mcusr_mirror;
@@ -50,27 +178,46 @@ INIT_FUNC_3 void early_init(void)
 
 INIT_FUNC_8 void late_init(void)
 {
-	uart_init(BAUDRATE_38400);
+	uart_init();
 	pfmt_out(PSTR("\r\nMCUSR: "));
 	pfmt_print_bits(PSTR("PEBW"), mcusr_mirror);
+#if defined OUTPUT_FRAMES
+	sframe_sync();
+#endif
 
-	tick_init();
-	sampler_init();
+	sampler_init(0);
 }
 
+#if defined OUTPUT_TEXT
+int main()
+{
+	sei();
+	for(;;)
+	{
+		cadence_wait();
+		const uint32_t i_level = cadence_measure();
+
+		FOUT2("Light: $l0",i_level>>16,i_level&0xFFFF);
+	}
+}
+#elif defined OUTPUT_FRAMES
 int main()
 {
+	ucd_serial_sample_type frame;
+
+	frame.seq = 0;
 	sei();
 	for(;;)
 	{
-		tick_wait();
-		const uint16_t raw = sampler_get_next_sample();
-		const uint16_t level = fp_reciprocal(raw);
-		const uint32_t i_level = fp_to_uint32(level);
-
-		/*
-		  FOUT2("Data: $0 Lvl: $1", raw, level);
-		*/
-		FOUT2("Light: $0$1",i_level>>16,i_level&0xFFFF);
+		cadence_wait();
+		const uint32_t level = cadence_measure();
+		frame.prescaler = sampler_get_prescaler();
+		frame.raw = sampler_get_raw();
+		frame.value = fp_from_uint32(level);
+		sframe_send(&frame, sizeof(frame));
+		++frame.seq;
 	}
 }
+#else
+#error no OUTPUT_XXX defined
+#endif
@@ -0,0 +1,42 @@
+/*
+ * COBS framing with CRC-8 for the serial output
+ */
+
+#include "sframe.h"
+#include "serial_api.h"
+#include "uart.h"
+#include <string.h>
+#include <util/crc16.h>
+
+void sframe_sync(void)
+{
+	uart_putchar(SFRAME_DELIMITER);
+}
+
+void sframe_send(const void *payload, uint8_t len)
+{
+	uint8_t buf[SFRAME_MAX_PAYLOAD + 1];
+	uint8_t crc = 0;
+	uint8_t i;
+
+	memcpy(buf, payload, len);
+	for(i = 0; i != len; ++i)
+		crc = _crc8_ccitt_update(crc, buf[i]);
+	buf[len++] = crc;
+
+	/* each zero is replaced by the distance to the next, the first by a leading code */
+	i = 0;
+	for(;;)
+	{
+		uint8_t run = 0;
+		while ( i + run != len && buf[i + run] )
+			++run;
+		uart_putchar(run + 1);
+		for(; run; --run)
+			uart_putchar(buf[i++]);
+		if ( i == len )
+			break;
+		++i;
+	}
+	uart_putchar(SFRAME_DELIMITER);
+}
@@ -0,0 +1,19 @@
+#ifndef SFRAME_H_INC
+#define SFRAME_H_INC
+
+#include <stdint.h>
+
+/*
+ * Output payload as a frame of serial_api.h
+ *
+ * - len is at most SFRAME_MAX_PAYLOAD
+ */
+void sframe_send(const void *payload, uint8_t len);
+
+/*
+ * Output a lone delimiter, ends whatever text preceded the first frame
+ *
+ */
+void sframe_sync(void);
+
+#endif // SFRAME_H_INC
@@ -0,0 +1,172 @@
+/*
+ * Host check of the HID Sensor report descriptor: walks the items the way
+ * a HID parser does and checks sizes and usages the kernel driver
+ * (hid-sensor-als) looks for against the report structures in ucd_api.h
+ */
+#include <stdio.h>
+#include <stdint.h>
+#include "ucd_api.h"
+
+#define WITH_HID_SENSOR 1
+#include "usbdrv/usbconfig.h"
+
+#define SENSOR_USAGE(id) (0x00200000UL | (id))
+
+static const unsigned char descriptor[] = {
+#include "hid_sensor_descriptor.inc"
+};
+
+enum { REPORT_INPUT, REPORT_FEATURE, REPORT_TYPES };
+
+struct parse_state
+{
+	uint32_t usage_page;
+	uint32_t report_size;
+	uint32_t report_count;
+	uint32_t report_id;
+	uint32_t usages[16];
+	unsigned int nusages;
+	int depth;
+	uint32_t collection_usage; /* usage of the outermost collection */
+	uint32_t property; /* usage of the logical collection around a selector array */
+	int collection_type;
+	unsigned int bits[REPORT_TYPES];
+	/* required usages, set when found in a report of the right type */
+	int has_illuminance;
+	int has_reporting_state;
+	int has_power_state;
+	int has_report_interval;
+	int has_sensitivity;
+	int errors;
+};
+
+#define CHECK(st, cond) do {						\
+		if ( !(cond) ) {					\
+			printf("FAIL: %s\n", #cond);			\
+			++(st)->errors;					\
+		}							\
+	} while(0)
+
+static void main_item(struct parse_state *st, int type)
+{
+	/* arrays and variables alike take size * count bits */
+	st->bits[type] += st->report_size * st->report_count;
+	CHECK(st, st->report_id == UCD_SENSOR_REPORT_ID);
+	/* selectors of an array stand for the property around them */
+	if ( st->depth > 1 )
+		st->usages[st->nusages++] = st->property;
+	for(unsigned int i = 0; i != st->nusages; ++i)
+	{
+		const uint32_t usage = st->usages[i];
+		if ( REPORT_INPUT == type && SENSOR_USAGE(0x04D1) == usage )
+		{
+			CHECK(st, st->report_size == 16);
+			st->has_illuminance = 1;
+		}
+		if ( REPORT_FEATURE == type && SENSOR_USAGE(0x0316) == usage )
+			st->has_reporting_state = 1;
+		if ( REPORT_FEATURE == type && SENSOR_USAGE(0x0319) == usage )
+			st->has_power_state = 1;
+		if ( REPORT_FEATURE == type && SENSOR_USAGE(0x030E) == usage )
+		{
+			CHECK(st, st->report_size == 32);
+			st->has_report_interval = 1;
+		}
+		if ( REPORT_FEATURE == type && SENSOR_USAGE(0x14D0) == usage )
+		{
+			CHECK(st, st->report_size == 16);
+			st->has_sensitivity = 1;
+		}
+	}
+}
+
+static void parse(struct parse_state *st, const unsigned char *p, size_t size)
+{
+	const unsigned char * const end = p + size;
+
+	while ( p < end )
+	{
+		const unsigned int prefix = *p++;
+		CHECK(st, prefix != 0xFE); /* no long items */
+		const unsigned int len = (prefix & 3) == 3 ? 4 : (prefix & 3);
+		if ( p + len > end )
+		{
+			printf("FAIL: item at %zu runs past the end\n", size - (end - p) - 1);
+			++st->errors;
+			return;
+		}
+		uint32_t data = 0;
+		for(unsigned int i = 0; i != len; ++i)
+			data |= (uint32_t)p[i] << (8*i);
+		p += len;
+
+		switch ( prefix & 0xFC )
+		{
+		/* main */
+		case 0x80: main_item(st, REPORT_INPUT); st->nusages = 0; break;
+		case 0xB0: main_item(st, REPORT_FEATURE); st->nusages = 0; break;
+		case 0xA0:
+			if ( !st->depth++ )
+			{
+				st->collection_type = data;
+				st->collection_usage = st->nusages ? st->usages[0] : 0;
+			}
+			else
+			{
+				CHECK(st, st->nusages == 1);
+				st->property = st->usages[0];
+			}
+			st->nusages = 0;
+			break;
+		case 0xC0:
+			CHECK(st, st->depth > 0);
+			--st->depth;
+			st->nusages = 0;
+			break;
+		/* global */
+		case 0x04: st->usage_page = data; break;
+		case 0x74: st->report_size = data; break;
+		case 0x94: st->report_count = data; break;
+		case 0x84: st->report_id = data; break;
+		case 0x14: case 0x24: case 0x34: case 0x44: case 0x54: case 0x64:
+			break;
+		/* local */
+		case 0x08:
+			CHECK(st, st->nusages < 15);
+			st->usages[st->nusages++] = len == 4 ? data : (st->usage_page << 16) | data;
+			break;
+		default:
+			printf("FAIL: unexpected item %02x\n", prefix);
+			++st->errors;
+			break;
+		}
+	}
+}
+
+int main(void)
+{
+	struct parse_state st = { .report_id = 0 };
+
+	printf("descriptor: %zu bytes\n", sizeof(descriptor));
+	CHECK(&st, sizeof(descriptor) == USB_CFG_HID_REPORT_DESCRIPTOR_LENGTH);
+
+	parse(&st, descriptor, sizeof(descriptor));
+
+	printf("input: %u bits, feature: %u bits\n",
+	       st.bits[REPORT_INPUT], st.bits[REPORT_FEATURE]);
+	CHECK(&st, st.depth == 0);
+	CHECK(&st, st.collection_type == 0x00); /* physical, as the sensor hub expects */
+	CHECK(&st, st.collection_usage == SENSOR_USAGE(0x41));
+	CHECK(&st, st.bits[REPORT_INPUT] == 8 * (sizeof(ucd_sensor_input_report_type) - 1));
+	CHECK(&st, st.bits[REPORT_FEATURE] == 8 * (sizeof(ucd_sensor_feature_report_type) - 1));
+	CHECK(&st, st.has_illuminance);
+	CHECK(&st, st.has_reporting_state);
+	CHECK(&st, st.has_power_state);
+	CHECK(&st, st.has_report_interval);
+	CHECK(&st, st.has_sensitivity);
+	/* interrupt reports are a single low speed packet */
+	CHECK(&st, sizeof(ucd_sensor_input_report_type) <= 8);
+
+	printf("%s\n", st.errors ? "FAILED" : "ok");
+	return !!st.errors;
+}
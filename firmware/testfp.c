@@ -83,10 +83,11 @@ void test_reciprocal(void)
 
 void test_integer_print(fp16_t fp)
 {
-	printf("fp=%04x i32=%08x i16l=%04x\n",
+	printf("fp=%04x i32=%08x i16l=%04x back=%04x\n",
 	       fp,
 	       fp_to_uint32(fp),
-	       fp_to_uint16(fp));
+	       fp_to_uint16(fp),
+	       fp_from_uint32(fp_to_uint32(fp)));
 }
 
 void test_integer(void)
@@ -98,6 +99,27 @@ void test_integer(void)
 	test_integer_print(0xFFFF);
 }
 
+/* every integer an fp16 holds exactly comes back from fp_from_uint32 */
+int test_integer_roundtrip(void)
+{
+	int failures = 0;
+	unsigned int fp;
+	for(fp=0; fp!=0x10000; ++fp)
+	{
+		if ( !fp_extract_sig(fp) )
+			continue;
+		const uint32_t value = fp_to_uint32(fp);
+		const uint32_t back = fp_to_uint32(fp_from_uint32(value));
+		if ( back != value )
+		{
+			if ( failures++ < 8 )
+				printf("round trip: fp=%04x %08x -> %08x\n", fp, value, back);
+		}
+	}
+	printf("round trip: %d failures\n", failures);
+	return failures;
+}
+
 
 uint16_t idiv_r(uint16_t n, uint16_t d)
 {
@@ -276,7 +298,7 @@ int main()
 {
 //	test_idiv();
 //	test_division();
-//	test_integer();
+	test_integer();
 
 //	test_reciprocal();
 	test_conversion();
@@ -291,4 +313,5 @@ int main()
 		printf("%04x %08x %04x\r\n", fp, u32, u16);
 	}
 #endif
+	return test_integer_roundtrip() ? 1 : 0;
 }
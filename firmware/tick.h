@@ -0,0 +1,22 @@
+/**
+ *  millisecond tick on timer0, usable from assembler sources too
+ */
+
+#ifndef TICK_H_INC
+#define TICK_H_INC
+
+#include <avr/io.h>
+
+#if F_CPU/64/1000 > 256
+#define TICK_DIVIDER 256
+#define TICK_CS _BV(CS02)
+#else
+#define TICK_DIVIDER 64
+#define TICK_CS ( _BV(CS01) | _BV(CS00) )
+#endif
+#define TICK_OCR ( (F_CPU/TICK_DIVIDER + 500)/1000 - 1 )
+#if TICK_OCR > 255
+#error tick period does not fit timer0 at this F_CPU
+#endif
+
+#endif /* TICK_H_INC */
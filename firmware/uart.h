@@ -1,8 +1,18 @@
 #ifndef UART_H_INC
 #define UART_H_INC
 
-void uart_init(uint8_t divisor);
+/*
+ * - bit rate is UART_BAUD of uart_config.h, fixed at build time
+ * - transmit runs from timer0, which also counts uart_ticks at UART_TICK_HZ
+ * - receive runs from the pin change interrupt, uart_getchar() returns -1
+ *   while nothing was received
+ * - receive holds off the other interrupts for a whole byte, and sets
+ *   UART_RX_SEEN_BIT in UART_STATE (uart_config.h) each time
+ */
+void uart_init(void);
 void uart_putchar(char ch);
 int uart_getchar(void);
 
+extern volatile uint8_t uart_ticks;
+
 #endif // UART_H_INC
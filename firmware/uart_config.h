@@ -5,18 +5,110 @@
 /* value bit for transmission */
 #define UART_TXB  PB2
 
-/* direction bit for receiving */
-#define UART_RXDB DDB3
+/* direction bit for receiving, PB0 is free: the comparator uses the bandgap */
+#define UART_RXDB DDB0
 
 /* value bit for receiving */
-#define UART_RXB  PB3
+#define UART_RXB  PB0
+
+/* pin change interrupt of the receive pin */
+#define UART_RX_PCINT PCINT0
 
 /* port to use */
 #define UART_PORT PORTB
 #define UART_PIN  PINB
 
+/* level of the next transmitted bit and clock state, in reach of sbis/sbic */
+#define UART_STATE GPIOR0
+#define UART_TX_LEVEL_BIT 0
+#define UART_TX_IDLE_BIT 1
+/* set by every received byte, cleared by the user */
+#define UART_RX_SEEN_BIT 2
+
+/* bits left to the next tick, 16 bit count down */
+#define UART_TICK_LO GPIOR1
+#define UART_TICK_HI GPIOR2
+
 
 #define UART_TX_ENABLE 1
-/*
 #define UART_RX_ENABLE 1
-*/
+
+/*
+ * Bit rate, FEAT_BAUD of the Makefile
+ */
+#ifndef UART_BAUD
+#define UART_BAUD 115200
+#endif
+
+#define UART_BIT_CYCLES ((F_CPU + UART_BAUD/2)/UART_BAUD)
+
+/*
+ * Transmit is clocked by timer0 in CTC mode, one bit per compare match,
+ * the same interrupt divides down the tick of the serial build
+ * - while the ring is empty the timer runs UART_IDLE_BITS times slower,
+ *   the interrupt then only keeps the tick and watches the ring
+ */
+#if UART_BIT_CYCLES <= 256
+#define UART_TIMER_DIVIDER 1
+#define UART_TIMER_CS _BV(CS00)
+#define UART_IDLE_CS (_BV(CS01)|_BV(CS00)) /* clk/64 */
+#define UART_IDLE_BITS 64
+#else
+#define UART_TIMER_DIVIDER 8
+#define UART_TIMER_CS _BV(CS01)
+#define UART_IDLE_CS _BV(CS02) /* clk/256 */
+#define UART_IDLE_BITS 32
+#endif
+#define UART_TIMER_COUNTS ((F_CPU/UART_TIMER_DIVIDER + UART_BAUD/2)/UART_BAUD)
+#define UART_TIMER_OCR (UART_TIMER_COUNTS - 1)
+
+/*
+ * The longest transmit interrupt at the bit rate, a start bit, response
+ * and vector jump included, counted in uart.S; the empty ring path is
+ * longer but restarts the timer first. It enables interrupts early and
+ * the sampler capture or overflow interrupt (sampler_irq.S) can run
+ * inside it: both together must end within a bit, or the next edge is late
+ */
+#define UART_TX_ISR_CYCLES 68
+#define UART_TX_NESTED_CYCLES 32
+#define UART_TX_MIN_BIT_CYCLES (UART_TX_ISR_CYCLES + UART_TX_NESTED_CYCLES)
+
+#define UART_TICK_HZ 100
+#define UART_TICK_BITS \
+	((F_CPU/UART_TIMER_DIVIDER/UART_TIMER_COUNTS + UART_TICK_HZ/2)/UART_TICK_HZ)
+
+/*
+ * Receive starts on the pin change of the start bit and samples the byte
+ * with delay loops inside the interrupt
+ * - loop of a bit: 3*UART_RX_LOOPS + 7 + UART_RX_PAD cycles
+ * - start bit edge to the middle of bit 0 is 1.5 bits, 21 cycles of it go
+ *   to interrupt entry and prologue
+ */
+#define UART_RX_LOOPS ((UART_BIT_CYCLES - 7)/3)
+#define UART_RX_PAD ((UART_BIT_CYCLES - 7)%3)
+#define UART_RX_FIRST_LOOPS ((UART_BIT_CYCLES*3/2 - 21)/3)
+#define UART_RX_FIRST_PAD ((UART_BIT_CYCLES*3/2 - 21)%3)
+
+/* rate error in per mille, the bit clock is rounded to whole counts */
+#define UART_ABS_DIFF__(a, b) ( (a) > (b) ? (a) - (b) : (b) - (a) )
+#define UART_TX_ERROR \
+	(UART_ABS_DIFF__(F_CPU/UART_TIMER_DIVIDER, UART_TIMER_COUNTS*UART_BAUD)*1000/(F_CPU/UART_TIMER_DIVIDER))
+#define UART_RX_ERROR \
+	(UART_ABS_DIFF__(F_CPU, UART_BIT_CYCLES*UART_BAUD)*1000/F_CPU)
+
+#if UART_TX_ERROR > 20 || UART_RX_ERROR > 20
+#error UART_BAUD is more than 2% off at this F_CPU
+#endif
+#if UART_TIMER_COUNTS > 256
+#error UART_BAUD is too low for the timer0 bit clock
+#endif
+#if UART_BIT_CYCLES < UART_TX_MIN_BIT_CYCLES
+#error UART_BAUD is too high, the transmit interrupt cannot keep up
+#endif
+#if UART_RX_LOOPS > 255 || UART_RX_FIRST_LOOPS > 255
+#error UART_BAUD is too low for the receive delay loops
+#endif
+
+/* rings, powers of two */
+#define UART_TX_SIZE 32
+#define UART_RX_SIZE 8
@@ -14,27 +14,208 @@
 	typedef char token_paste__(assertion_failed_line_,loc_line)[2*(!!(cond))-1];
 #define CASSERT(cond) CASSERT_impl__(cond, __LINE__)
 
+/* the device has no alignment, host compilers need to be told so */
+#if defined(__GNUC__) && !defined(__AVR__)
+#define UCD_PACKED __attribute__((packed))
+#else
+#define UCD_PACKED
+#endif
+
 #define UCD_FEATURE_REPORT_COUNT 16
+#define UCD_INPUT_BATCH_SIZE 3
+#define UCD_INPUT_HEADER_SIZE 4
+
+/*
+ * Input report: a batch of consecutive filtered samples
+ *
+ * - seq counts samples, host detects lost samples by gaps in seq
+ * - prescaler of each sample is packed by nibbles, sample 0 in the low one
+ * - stamp is the device millisecond tick a sample was completed at,
+ *   it wraps every 65.536 s
+ */
+typedef struct
+{
+	uint8_t seq;
+	uint8_t count;
+	uint8_t prescaler[(UCD_INPUT_BATCH_SIZE+1)/2];
+	uint16_t sample[UCD_INPUT_BATCH_SIZE];
+	uint16_t stamp[UCD_INPUT_BATCH_SIZE];
+}UCD_PACKED ucd_input_report_type;
+CASSERT(sizeof(ucd_input_report_type) == UCD_INPUT_HEADER_SIZE + 4*UCD_INPUT_BATCH_SIZE);
+
+#define UCD_REPORT_PRESCALER(report, i)					\
+	( ((report)->prescaler[(i)>>1] >> (((i)&1)<<2)) & 0x0F )
+
+/* vendor usages of input report fields */
+#define UCD_USAGE_SAMPLE 0x01
+#define UCD_USAGE_HEADER 0x02
+#define UCD_USAGE_STAMP 0x03
 
 typedef struct
 {
 	uint8_t subrq_id;
-}ucd_mux_request_type;
+}UCD_PACKED ucd_mux_request_type;
 CASSERT(sizeof(ucd_mux_request_type) == 1);
 
+/* parameter flags */
+#define UCD_PARAM_FLAG_EVENT_MODE 0x0001 /* report only changes beyond hysteresis */
+
 typedef struct
 {
 	int8_t sensitivity;
 	uint16_t flags;
-	uint8_t padding[13];
-}ucd_parameters_request_type;
+	uint16_t report_interval; /* ms between interrupt reports, 0 - as soon as samples arrive, 250 by default */
+	uint8_t hysteresis_shift; /* event mode: change threshold is value >> shift, 0..15 */
+	uint16_t keepalive; /* event mode: max ms without a report, 0 - unlimited */
+	uint8_t ir_weight; /* multi-channel: channel 1 * ir_weight/256 is taken off channel 0 */
+	uint8_t padding[7];
+}UCD_PACKED ucd_parameters_request_type;
 CASSERT(sizeof(ucd_parameters_request_type) == 16);
 
+/*
+ * Capabilities, constant for a firmware build
+ * - firmware without this subrequest returns zero version
+ */
+#define UCD_PROTOCOL_VERSION 0x0300 /* major << 8 | minor */
+
+/* input report formats */
+#define UCD_FORMAT_BATCH 0x01 /* ucd_input_report_type, stamped since 3.0 */
+#define UCD_FORMAT_HID_SENSOR 0x02 /* ucd_sensor_input_report_type */
+#define UCD_FORMAT_CHANNELS 0x04 /* ucd_input_report_type, one round over the channels: sample n is channel n */
+
+/* optional features */
+#define UCD_FEATURE_VENDOR_RQ 0x01
+#define UCD_FEATURE_EVENT_MODE 0x02
+#define UCD_FEATURE_HISTORY 0x04
+#define UCD_FEATURE_STATS 0x08
+#define UCD_FEATURE_PROFILE 0x10
+#define UCD_FEATURE_RAW_STREAM 0x20
+
+typedef struct
+{
+	uint16_t version;
+	uint8_t formats;
+	uint8_t features;
+	uint16_t max_rate; /* samples per second the interrupt endpoint can carry */
+	uint8_t history_size; /* entries of the history ring, 0 - no history */
+	uint8_t batch_size; /* samples per input report */
+	uint8_t channels; /* sensor channels, 0 - older firmware with one */
+	uint8_t padding[7];
+}UCD_PACKED ucd_caps_request_type;
+CASSERT(sizeof(ucd_caps_request_type) == 16);
+
+/*
+ * Runtime statistics, counters are free running, the host diffs them
+ * - writing the stats subrequest clears max_loop and the prescaler hits
+ */
+typedef struct
+{
+	uint16_t samples; /* samples taken */
+	uint16_t sample_rate; /* samples taken during the last second */
+	uint16_t overflows; /* ranging towards slower clock */
+	uint16_t underflows; /* ranging towards faster clock */
+	uint16_t reports; /* interrupt reports queued */
+	uint16_t max_loop; /* longest main loop iteration: ms << 8 | timer counts */
+	uint8_t tick_counts; /* timer counts per ms, scale of max_loop low byte */
+	uint8_t eeprom_pending; /* bytes of EEPROM write still pending */
+	uint8_t reset_cause; /* MCUSR at boot, UCD_RESET_WARM if the state was kept */
+	uint8_t padding[1];
+}UCD_PACKED ucd_stats_request_type;
+CASSERT(sizeof(ucd_stats_request_type) == 16);
+
+#define UCD_RESET_WARM 0x80
+
+/* samples taken per prescaler 1..15, all bins are halved when one saturates */
+#define UCD_PRESCALER_COUNT 15
+typedef struct
+{
+	uint8_t hits[UCD_PRESCALER_COUNT];
+	uint8_t padding;
+}UCD_PACKED ucd_prescaler_hits_request_type;
+CASSERT(sizeof(ucd_prescaler_hits_request_type) == 16);
+
+/*
+ * Profile (profiling builds only): timing of one pipeline stage
+ * - times are wall time in timer0 counts of count_cycles CPU cycles,
+ *   interrupts taken meanwhile included
+ * - writing any profile subrequest clears all stages, prescaler
+ *   selects the only prescaler to record at, 0 - any
+ */
+#define UCD_PROFILE_USB_POLL 0
+#define UCD_PROFILE_REPORT_SEND 1
+#define UCD_PROFILE_SAMPLER_POLL 2
+#define UCD_PROFILE_FP_INVERSE 3
+#define UCD_PROFILE_FILTER 4
+#define UCD_PROFILE_CAPTURE_ISR 5
+#define UCD_PROFILE_OVERFLOW_ISR 6
+#define UCD_PROFILE_STAGES 7
+
+typedef struct
+{
+	uint16_t runs;
+	uint16_t min;
+	uint16_t max;
+	uint32_t total;
+	uint16_t count_cycles;
+	uint8_t prescaler;
+	uint8_t padding[3];
+}UCD_PACKED ucd_profile_request_type;
+CASSERT(sizeof(ucd_profile_request_type) == 16);
+
+/*
+ * Raw capture stream (WITH_RAW_STREAM): one capture per interrupt packet
+ * on endpoint 3, which has a vendor class interface of its own so that
+ * diagnostic hosts claim it through usbfs while usbhid keeps interface 0
+ * - a capture the host has not collected is replaced by the next one,
+ *   the host sees the gap in seq
+ */
+#define UCD_RAW_INTERFACE 1
+#define UCD_RAW_ENDPOINT 0x83
+
+#define UCD_RAW_FLAG_OVERFLOW 0x01 /* ranging towards slower clock */
+#define UCD_RAW_FLAG_UNDERFLOW 0x02 /* ranging towards faster clock */
+#define UCD_RAW_CHANNEL(flags) ( (flags) >> 4 )
+
+typedef struct
+{
+	uint8_t seq; /* counts captures */
+	uint8_t prescaler;
+	uint8_t value; /* timer1 count at the comparator trip, 0xFF - timer overflow */
+	uint8_t flags;
+	uint16_t stamp; /* ms tick the capture completed at */
+	uint16_t filtered; /* filtered value with this capture in */
+}UCD_PACKED ucd_raw_capture_type;
+CASSERT(sizeof(ucd_raw_capture_type) == 8);
+
+/*
+ * History report: delta-encoded ring of recent filtered samples
+ *
+ * - one entry every 'period' ms, newest value is kept in 'last'
+ * - ring is read backwards from 'head': each entry yields the value
+ *   preceding the one already known
+ * - a byte other than UCD_HISTORY_ESCAPE is a signed delta to subtract,
+ *   UCD_HISTORY_ESCAPE is preceded by the previous value, high byte first
+ */
+#define UCD_HISTORY_SIZE 32
+#define UCD_HISTORY_PERIOD 500
+#define UCD_HISTORY_ESCAPE 0x80
+
+typedef struct
+{
+	uint8_t head; /* ring index the next entry is written at */
+	uint8_t fill; /* number of valid ring bytes */
+	uint8_t samples; /* number of values recorded, saturates at 255 */
+	uint16_t last;
+	uint16_t period;
+	uint8_t ring[UCD_HISTORY_SIZE];
+}UCD_PACKED ucd_history_report_type;
+CASSERT(sizeof(ucd_history_report_type) == 7 + UCD_HISTORY_SIZE);
+
 typedef struct ucd_calibration_param
 {
 	char id[4];
 	uint16_t param[6];
-}ucd_calibration_request_type;
+}UCD_PACKED ucd_calibration_request_type;
 CASSERT(sizeof(ucd_calibration_request_type) == 16);
 
 /*
@@ -42,6 +223,9 @@ CASSERT(sizeof(ucd_calibration_request_type) == 16);
  */
 #define UCD_SUBRQ_MUX_REPORT_ID 1
 #define UCD_SUBRQ_PARAMETERS 1
+#define UCD_SUBRQ_STATS 2
+#define UCD_SUBRQ_PRESCALER_HITS 3
+#define UCD_SUBRQ_CAPS 4
 #define UCD_SUBRQ_CALIBRATION_SET_0 0x10
 #define UCD_SUBRQ_CALIBRATION_SET_1 0x11
 #define UCD_SUBRQ_CALIBRATION_SET_2 0x12
@@ -50,11 +234,56 @@ CASSERT(sizeof(ucd_calibration_request_type) == 16);
 #define UCD_SUBRQ_CALIBRATION_SET_5 0x15
 #define UCD_SUBRQ_CALIBRATION_SET_6 0x16
 #define UCD_SUBRQ_CALIBRATION_SET_7 0x17
+#define UCD_SUBRQ_PROFILE_0 0x20 /* stage n at UCD_SUBRQ_PROFILE_0 + n */
 
 /*
  *
  */
 #define UCD_SUBRQ_DATA_REPORT_ID 2
 
+/*
+ * vendor requests, single transfer access to subrequests
+ * - wValue: subrequest id
+ * - data stage: UCD_FEATURE_REPORT_COUNT bytes of subrequest data, no report id
+ */
+#define UCD_VENDOR_RQ_GET 1
+#define UCD_VENDOR_RQ_SET 2
+
+/*
+ * history is too long for the data report and has its own
+ */
+#define UCD_SUBRQ_HISTORY_REPORT_ID 3
+
+/*
+ * HID Sensor build (WITH_HID_SENSOR): ambient light sensor
+ * per HID Sensor Usage Tables, both reports share one report id
+ * - feature: reporting state, power state, report interval, sensitivity
+ * - input: illuminance
+ */
+#define UCD_SENSOR_REPORT_ID 1
+
+/* enumerator indices of the selector arrays */
+#define UCD_SENSOR_REPORTING_NO_EVENTS 0
+#define UCD_SENSOR_REPORTING_ALL_EVENTS 1
+#define UCD_SENSOR_POWER_UNDEFINED 0
+#define UCD_SENSOR_POWER_D0 1
+
+typedef struct
+{
+	uint8_t report_id;
+	uint8_t reporting_state;
+	uint8_t power_state;
+	uint32_t report_interval; /* ms, 0..65535 */
+	uint16_t sensitivity; /* absolute change of illuminance */
+}UCD_PACKED ucd_sensor_feature_report_type;
+CASSERT(sizeof(ucd_sensor_feature_report_type) == 9);
+
+typedef struct
+{
+	uint8_t report_id;
+	uint16_t illuminance;
+}UCD_PACKED ucd_sensor_input_report_type;
+CASSERT(sizeof(ucd_sensor_input_report_type) == 3);
+
 #endif /* UC_API_H_INC */
 
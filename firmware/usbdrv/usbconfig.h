@@ -80,7 +80,11 @@ section at the end of this file).
  * default control endpoint 0 and an interrupt-in endpoint (any other endpoint
  * number).
  */
+#if WITH_RAW_STREAM
+#define USB_CFG_HAVE_INTRIN_ENDPOINT3   1
+#else
 #define USB_CFG_HAVE_INTRIN_ENDPOINT3   0
+#endif
 /* Define this to 1 if you want to compile a version with three endpoints: The
  * default control endpoint 0, an interrupt-in endpoint 3 (or the number
  * configured below) and a catch-all default interrupt-in endpoint as above.
@@ -110,7 +114,7 @@ section at the end of this file).
  * (e.g. HID), but never want to send any data. This option saves a couple
  * of bytes in flash memory and the transmit buffers in RAM.
  */
-#define USB_CFG_INTR_POLL_INTERVAL      250
+#define USB_CFG_INTR_POLL_INTERVAL      10
 /* If you compile a version with endpoint 1 (interrupt-in), this is the poll
  * interval. The value is in milliseconds and must not be less than 10 ms for
  * low speed devices.
@@ -129,7 +133,11 @@ section at the end of this file).
  * transfers. Set it to 0 if you don't need it and want to save a couple of
  * bytes.
  */
+#if WITH_HISTORY
+#define USB_CFG_IMPLEMENT_FN_READ       1
+#else
 #define USB_CFG_IMPLEMENT_FN_READ       0
+#endif
 /* Set this to 1 if you need to send control replies which are generated
  * "on the fly" when usbFunctionRead() is called. If you only want to send
  * data from a static buffer, set it to 0 and return the data from
@@ -163,7 +171,12 @@ section at the end of this file).
  * proceed, do a return after doing your things. One possible application
  * (besides debugging) is to flash a status LED on each packet.
  */
-/* #define USB_RESET_HOOK(resetStarts)     if(!resetStarts){hadUsbReset();} */
+#if WITH_OSCCAL
+#ifndef __ASSEMBLER__
+extern void osccal_calibrate(void);
+#endif
+#define USB_RESET_HOOK(resetStarts)     if(!resetStarts){osccal_calibrate();}
+#endif
 /* This macro is a hook if you need to know when an USB RESET occurs. It has
  * one parameter which distinguishes between the start of RESET state and its
  * end.
@@ -204,7 +217,11 @@ section at the end of this file).
  * usbFunctionWrite(). Use the global usbCurrentDataToken and a static variable
  * for each control- and out-endpoint to check for duplicate packets.
  */
+#if WITH_OSCCAL
+#define USB_CFG_HAVE_MEASURE_FRAME_LENGTH   1
+#else
 #define USB_CFG_HAVE_MEASURE_FRAME_LENGTH   0
+#endif
 /* define this macro to 1 if you want the function usbMeasureFrameLength()
  * compiled in. This function can be used to calibrate the AVR's RC oscillator.
  */
@@ -280,7 +297,13 @@ section at the end of this file).
  * HID class is 3, no subclass and protocol required (but may be useful!)
  * CDC class is 2, use subclass 2 and protocol 1 for ACM
  */
-#define USB_CFG_HID_REPORT_DESCRIPTOR_LENGTH    49
+#if WITH_HID_SENSOR
+#define USB_CFG_HID_REPORT_DESCRIPTOR_LENGTH    93
+#elif WITH_HISTORY
+#define USB_CFG_HID_REPORT_DESCRIPTOR_LENGTH    71
+#else
+#define USB_CFG_HID_REPORT_DESCRIPTOR_LENGTH    62
+#endif
 /* Define this to the length of the HID report descriptor, if you implement
  * an HID device. Otherwise don't define it or define it to 0.
  * If you use this define, you must add a PROGMEM character array named
@@ -346,7 +369,12 @@ section at the end of this file).
  */
 
 #define USB_CFG_DESCR_PROPS_DEVICE                  0
+#if WITH_RAW_STREAM
+/* endpoint 3 sits on an interface of its own, see main.c */
+#define USB_CFG_DESCR_PROPS_CONFIGURATION           USB_PROP_LENGTH(50)
+#else
 #define USB_CFG_DESCR_PROPS_CONFIGURATION           0
+#endif
 #define USB_CFG_DESCR_PROPS_STRINGS                 0
 #define USB_CFG_DESCR_PROPS_STRING_0                0
 #define USB_CFG_DESCR_PROPS_STRING_VENDOR           0
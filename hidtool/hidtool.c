@@ -9,10 +9,19 @@
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <sys/ioctl.h>
+#include <sys/epoll.h>
+#include <poll.h>
+#include <sys/sysmacros.h>
 #include <fcntl.h>
+#include <limits.h>
 #include <dirent.h>
 #include <signal.h>
+#include <sys/wait.h>
 #include <linux/hiddev.h>
+#include <linux/hidraw.h>
+#include <linux/usb/ch9.h>
+#include <linux/usbdevice_fs.h>
+#include "ucd_api.h"
 
 
 /*
@@ -33,9 +42,20 @@
 #define WARN(fmt, ...) msg__(MSG_WARN, stderr, fmt, ##__VA_ARGS__)
 #define ERR(fmt, ...) msg__(MSG_ERR, stderr, fmt, ##__VA_ARGS__)
 
+#ifndef min
+#define min(a,b) ( ((a)<(b))?(a):(b) )
+#endif
+
 #define DEFAULT_VID 0x16C0
 #define DEFAULT_PID 0x05DF
 #define DEFAULT_SAMPLE_PERIOD 0
+#define USBDEV_TIMEOUT_MS 1000
+#define DEFAULT_REPORT_DEADLINE_MS 500
+#define HOOK_RESTART_DELAY 1.0 /* s between a hook exit and its restart */
+
+#ifndef F_SETPIPE_SZ
+#define F_SETPIPE_SZ 1031 /* linux, hidden behind _GNU_SOURCE */
+#endif
 
 /*
  * structures
@@ -56,14 +76,129 @@ struct hiddev_attr
 	struct hiddev_devinfo device_info;
 };
 
+/*
+ * Device node flavours: hiddev hands out reports usage by usage,
+ * hidraw passes them whole as the device sent them
+ */
+struct hid_backend
+{
+	char const *name;
+	char const *dir_default;
+	char const *node_prefix;
+	int open_flags;
+	int (*devinfo_fd)(int fd, struct hiddev_attr *attrs);
+	int (*init_report)(int fd); /* 0 - nothing to initialize */
+	int (*get_report)(int fd, uint8_t *buf, size_t buf_size);
+	int (*get_feature_report)(int fd, int report_id, unsigned char *buffer, size_t length);
+	int (*set_feature_report)(int fd, int report_id, const unsigned char *buffer, size_t length);
+	int (*report_info)(int fd);
+};
+
+/*
+ * hiddev input records read ahead: one read() takes all records queued,
+ * those past the report being assembled wait here for the next one.
+ * The fd is in HIDDEV_FLAG_UREF | HIDDEV_FLAG_REPORT mode, so records
+ * tell field and usage index, a report closes with HID_FIELD_INDEX_NONE
+ */
+#define HIDDEV_EVENT_BATCH 64
+
+struct hiddev_reader
+{
+	int fd;
+	int epfd;
+	unsigned int head;
+	unsigned int count;
+	double last_event; /* monotonic s of the last read or GET_REPORT */
+	struct hiddev_usage_ref events[HIDDEV_EVENT_BATCH];
+};
+
+/*
+ * Persistent hook: one process started with the command, values are
+ * written to its stdin. A record is written only while fewer than
+ * 'depth' records wait in the pipe, others are dropped, so a slow hook
+ * sees fresh values and never stalls report reading.
+ * Records are shorter than PIPE_BUF, non-blocking writes are all or nothing.
+ */
+enum hook_format
+{
+	HOOK_FORMAT_TEXT, /* "value time\n" */
+	HOOK_FORMAT_BINARY, /* struct hook_record */
+};
+
+struct hook_record
+{
+	uint32_t seq; /* counts records produced, gaps are drops */
+	int32_t value;
+	double time; /* CLOCK_MONOTONIC s the last averaged sample was taken */
+};
+
+struct hook
+{
+	char const *command;
+	enum hook_format format;
+	unsigned int depth;
+	pid_t pid; /* 0 - not running */
+	int fd; /* write end of the hook stdin, -1 while the hook is stopping */
+	double restart_at; /* monotonic s the hook may be started again */
+	double kill_at; /* monotonic s a stopping hook gets SIGKILL */
+	uint32_t seq;
+	unsigned long dropped;
+	unsigned int restarts;
+};
+
+/* per transaction latency of one kind, seconds */
+struct bench_stat
+{
+	unsigned int runs;
+	double min, max, total;
+};
+
+/* tracks sample sequence numbers across input reports */
+struct ucd_stream
+{
+	int synced;
+	uint8_t next_seq;
+	unsigned long lost;
+};
+
+/*
+ * maps device millisecond stamps to host CLOCK_MONOTONIC:
+ * host - device offsets are lowest for samples received with the least
+ * latency, a line through per block minima gives offset and drift
+ */
+#define UCD_CLOCK_BLOCK_MS 4000
+#define UCD_CLOCK_POINTS 32
+#define UCD_CLOCK_JUMP 0.05 /* s, sample arriving that much before it could - device restarted */
+
+struct ucd_clock
+{
+	int synced;
+	int64_t block_end; /* device ms the current block closes at */
+	double block_d, block_o; /* lowest offset point of the current block */
+	unsigned int npoints;
+	unsigned int head;
+	double point_d[UCD_CLOCK_POINTS]; /* device time, s */
+	double point_o[UCD_CLOCK_POINTS]; /* host - device time, s */
+	/* host = device + offset + drift * device */
+	double offset;
+	double drift;
+};
+
 
 /*
  * globals
  */
 static const char devusb_dir_default[] = "/dev/usb";
+static const char dev_dir_default[] = "/dev";
+static const char devbus_dir_default[] = "/dev/bus/usb";
 static int ARGC_=0;
 static char **ARGV_=0;
 static int g_msglevel = MSG_INFO;
+static int g_usbfd = -1; /* usbfs node for vendor requests, -1 if unavailable */
+static long g_report_deadline_ms = DEFAULT_REPORT_DEADLINE_MS; /* fetch input report when device is silent that long, 0 - wait for events */
+static struct hiddev_reader g_reader = { .fd = -1, .epfd = -1 };
+static ucd_caps_request_type g_caps; /* zero version if the firmware does not tell */
+static struct hid_backend const *g_backend; /* hiddev unless selected otherwise */
 
 /*
  * prototypes
@@ -77,8 +212,36 @@ int hiddev_devinfo(char const *name, struct hiddev_attr *attrs);
 int hiddev_devinfo_fd(int fd, struct hiddev_attr *attrs);
 int hiddev_init_report(int fd);
 int hiddev_get_report(int fd, uint8_t *buf, size_t buf_size);
+int hiddev_get_input_fields(int fd, ucd_input_report_type *report);
+int hiddev_reader_fill(struct hiddev_reader *reader, int fd);
+int report_wait_ms(double last_event);
+unsigned int ucd_stream_update(struct ucd_stream *stream, ucd_input_report_type const *report);
+void bench_stat_add(struct bench_stat *stat, double t);
+int hook_start(struct hook *hook);
+void hook_reap(struct hook *hook);
+int hook_send(struct hook *hook, int value, double time);
+double monotonic_now(void);
+int64_t ucd_clock_unwrap(struct ucd_clock const *clock, uint16_t stamp, double host);
+int64_t ucd_clock_update(struct ucd_clock *clock, uint16_t stamp, double host);
+void ucd_clock_fit(struct ucd_clock *clock);
+double ucd_clock_map(struct ucd_clock const *clock, uint16_t stamp, double host);
+unsigned int ucd_history_decode(ucd_history_report_type const *history, uint16_t *values, unsigned int max_values);
 int hiddev_get_feature_report(int fd, int report_id, unsigned char *buffer, size_t length);
 int hiddev_set_feature_report(int fd, int report_id, const unsigned char *buffer, size_t length);
+int hiddev_report_info(int fd);
+int hidraw_devinfo_fd(int fd, struct hiddev_attr *attrs);
+int hidraw_usb_location(int fd, struct hiddev_devinfo *info);
+int hidraw_get_report(int fd, uint8_t *buf, size_t buf_size);
+int hidraw_get_feature_report(int fd, int report_id, unsigned char *buffer, size_t length);
+int hidraw_set_feature_report(int fd, int report_id, const unsigned char *buffer, size_t length);
+int hidraw_report_info(int fd);
+struct hid_backend const *hid_backend_find(char const *name);
+int usbdev_open(struct hiddev_attr const *attrs);
+int ucd_vendor_get(int ufd, uint8_t subrq_id, void *buffer, size_t length);
+int ucd_vendor_set(int ufd, uint8_t subrq_id, const void *buffer, size_t length);
+int ucd_get_subrq(int fd, uint8_t subrq_id, void *buffer, size_t length);
+int ucd_caps_read(int fd, ucd_caps_request_type *caps);
+int ucd_set_subrq(int fd, uint8_t subrq_id, const void *buffer, size_t length);
 
 /*
  * basic code
@@ -174,9 +337,34 @@ exit:
 
 int do_command_info(int fd)
 {
-	do_report_info(fd, HID_REPORT_TYPE_INPUT);
-	do_report_info(fd, HID_REPORT_TYPE_OUTPUT);
-	do_report_info(fd, HID_REPORT_TYPE_FEATURE);
+	g_backend->report_info(fd);
+
+	if ( !g_caps.version )
+	{
+		fprintf(stdout, "capabilities: not reported\n");
+		return 0;
+	}
+	fprintf(stdout,
+		"capabilities:\n"
+		"\tprotocol: %u.%u\n"
+		"\tformats:%s%s%s\n"
+		"\tfeatures:%s%s%s%s%s%s\n"
+		"\tmax rate: %u samples/s, %u per report\n"
+		"\tchannels: %u\n"
+		"\thistory: %u entries\n",
+		g_caps.version >> 8, g_caps.version & 0xFF,
+		g_caps.formats & UCD_FORMAT_BATCH ? " batch" : "",
+		g_caps.formats & UCD_FORMAT_HID_SENSOR ? " hid-sensor" : "",
+		g_caps.formats & UCD_FORMAT_CHANNELS ? " channels" : "",
+		g_caps.features & UCD_FEATURE_VENDOR_RQ ? " vendor-rq" : "",
+		g_caps.features & UCD_FEATURE_EVENT_MODE ? " event-mode" : "",
+		g_caps.features & UCD_FEATURE_HISTORY ? " history" : "",
+		g_caps.features & UCD_FEATURE_STATS ? " stats" : "",
+		g_caps.features & UCD_FEATURE_PROFILE ? " profile" : "",
+		g_caps.features & UCD_FEATURE_RAW_STREAM ? " raw-stream" : "",
+		g_caps.max_rate, g_caps.batch_size,
+		g_caps.channels ? g_caps.channels : 1,
+		g_caps.history_size);
 	return 0;
 }
 
@@ -184,17 +372,17 @@ int do_command_getreport(int fd)
 {
 	uint8_t buf[256];
 
-	int err = hiddev_init_report(fd);
+	int err = g_backend->init_report ? g_backend->init_report(fd) : 0;
 	if ( err < 0 )
 	{
-		ERR("hiddev_init_report failure: %d", err);
+		ERR("init_report failure: %d", err);
 		goto exit;
 	}
 
-	err = hiddev_get_report(fd, buf, sizeof(buf));
+	err = g_backend->get_report(fd, buf, sizeof(buf));
 	if ( err < 0 )
 	{
-		ERR("hiddev_get_report failure: %d", err);
+		ERR("get_report failure: %d", err);
 		goto exit;
 	}
 	pretty_print_buffer(buf, err);
@@ -205,50 +393,113 @@ exit:
 
 int do_command_monitor(int fd)
 {
+	if ( g_caps.formats & UCD_FORMAT_HID_SENSOR )
+	{
+		ERR("monitor: the HID Sensor build reports illuminance only, read it through iio");
+		return -ENOTSUP;
+	}
+
 	int err;
 	unsigned int timeout = DEFAULT_SAMPLE_PERIOD;
 
 	int ch;
-	while ( (ch=getopt(ARGC_, ARGV_, "t:")) != -1 )
+	int persistent = 0;
+	struct hook hook = { .format = HOOK_FORMAT_TEXT, .depth = 1 };
+	while ( (ch=getopt(ARGC_, ARGV_, "t:p:q:")) != -1 )
 		switch ( ch )
 		{
 		case 't':
 			timeout = strtoul(optarg, 0, 0);
 			if ( !timeout ) return -EINVAL;
 			break;
+		case 'p':
+			persistent = 1;
+			if ( !strcmp(optarg, "text") )
+				hook.format = HOOK_FORMAT_TEXT;
+			else if ( !strcmp(optarg, "binary") )
+				hook.format = HOOK_FORMAT_BINARY;
+			else
+				return -EINVAL;
+			break;
+		case 'q':
+			hook.depth = strtoul(optarg, 0, 0);
+			if ( !hook.depth ) return -EINVAL;
+			break;
 		default: return -EINVAL;
 		}
 	shift_argv_n(optind);
 
-	const int xcmd = !!ARGC_;
+	const int xcmd = !!ARGC_ && !persistent;
 	if ( xcmd )
 		signal(SIGCHLD, SIG_IGN);
+	if ( persistent )
+	{
+		if ( ARGC_ != 1 )
+		{
+			ERR("persistent hook takes one command argument");
+			return -EINVAL;
+		}
+		/* a hook gone is found by EPIPE and restarted */
+		signal(SIGPIPE, SIG_IGN);
+		hook.command = ARGV_[0];
+		err = hook_start(&hook);
+		if ( err < 0 )
+			return err;
+	}
+
+	/* in event mode silence means no change, just wait for reports */
+	ucd_parameters_request_type params;
+	if ( (g_caps.features & UCD_FEATURE_EVENT_MODE)
+	     && ucd_get_subrq(fd, UCD_SUBRQ_PARAMETERS, &params, sizeof(params)) > 0
+	     && (params.flags & UCD_PARAM_FLAG_EVENT_MODE) )
+	{
+		DBG("device is in event mode");
+		g_report_deadline_ms = 0;
+	}
 
 	unsigned int average = 0;
 	unsigned int avg_count = 0;
-	time_t t_st = 0;
+	double t_st = 0;
+	double t_sample = 0;
 	char *s_output_value = 0;
 	size_t z_output_value = 0;
+	struct ucd_stream stream = { .synced = 0 };
+	struct ucd_clock clock = { .synced = 0 };
 	for(;;)
 	{
-		/* get sample */
-		int32_t value;
-		err = hiddev_get_report(fd, (uint8_t*)&value, sizeof(value));
+		/* get samples */
+		ucd_input_report_type report;
+		err = g_backend->get_report(fd, (uint8_t*)&report, sizeof(report));
 		if ( err < 0 )
 		{
-			ERR("hiddev_get_report failure: %d", err);
+			ERR("get_report failure: %d", err);
 			goto exit;
 		}
-		average += value;
-		avg_count++;
+		const double now = monotonic_now();
+		if ( report.count )
+			ucd_clock_update(&clock, report.stamp[report.count-1], now);
+		for(unsigned int i = ucd_stream_update(&stream, &report); i < report.count; ++i)
+		{
+			/* rounds over channels: channel 0 is the light level */
+			if ( (g_caps.formats & UCD_FORMAT_CHANNELS) && i )
+				continue;
+			average += report.sample[i];
+			avg_count++;
+			t_sample = ucd_clock_map(&clock, report.stamp[i], now);
+		}
+		if ( !avg_count ) continue;
 
-		/* check time */
-		const time_t now = time(0);
-		if ( now - t_st < timeout ) continue;
-		t_st = now;
+		/* periods follow the time samples were taken, not report arrival */
+		if ( t_sample - t_st < timeout ) continue;
+		t_st = t_sample;
 
 		/* compute average and produce output string */
 		average /= avg_count;
+		if ( persistent )
+		{
+			hook_send(&hook, average, t_sample);
+			goto next_cycle;
+		}
 		int n;
 	print_again:
 		n = snprintf(s_output_value, z_output_value, "_HID_VALUE=%d", average);
@@ -306,18 +557,84 @@ exit:
 
 int do_command_sample(int fd)
 {
-	int32_t value;
-	int err = hiddev_get_report(fd, (uint8_t *)&value, sizeof(value));
+	if ( g_caps.formats & UCD_FORMAT_HID_SENSOR )
+	{
+		ERR("sample: the HID Sensor build reports illuminance only, read it through iio");
+		return -ENOTSUP;
+	}
+
+	ucd_input_report_type report;
+	int err = g_backend->get_report(fd, (uint8_t *)&report, sizeof(report));
 	if ( err < 0 )
 	{
-		ERR("hiddev_get_report failure: %d", err);
+		ERR("get_report failure: %d", err);
+		goto exit;
+	}
+	if ( !report.count )
+	{
+		err = -EAGAIN;
+		ERR("no samples available");
 		goto exit;
 	}
-	fprintf(stdout, "%d\n", value);
+	if ( g_caps.formats & UCD_FORMAT_CHANNELS )
+	{
+		for(unsigned int i = 0; i != report.count; ++i)
+			fprintf(stdout, "%s%d", i ? " " : "", report.sample[i]);
+		fprintf(stdout, "\n");
+	}
+	else
+		fprintf(stdout, "%d\n", report.sample[report.count-1]);
 exit:
 	return err;
 }
 
+int do_command_stream(int fd)
+{
+	if ( g_caps.formats & UCD_FORMAT_HID_SENSOR )
+	{
+		ERR("stream: the HID Sensor build reports illuminance only, read it through iio");
+		return -ENOTSUP;
+	}
+
+	int err;
+	struct ucd_stream stream = { .synced = 0 };
+	struct ucd_clock clock = { .synced = 0 };
+	unsigned long lost = 0;
+
+	for(;;)
+	{
+		ucd_input_report_type report;
+		err = g_backend->get_report(fd, (uint8_t *)&report, sizeof(report));
+		if ( err < 0 )
+		{
+			ERR("get_report failure: %d", err);
+			break;
+		}
+
+		const double now = monotonic_now();
+		if ( report.count )
+			ucd_clock_update(&clock, report.stamp[report.count-1], now);
+		unsigned int i = ucd_stream_update(&stream, &report);
+		if ( stream.lost != lost )
+		{
+			WARN("lost %lu samples", stream.lost - lost);
+			lost = stream.lost;
+		}
+		for(; i < report.count; ++i)
+		{
+			if ( g_caps.formats & UCD_FORMAT_CHANNELS )
+				fprintf(stdout, "ch%u ", i);
+			fprintf(stdout, "%3u %5u %2u %.4f\n",
+				(uint8_t)(report.seq + i),
+				report.sample[i],
+				UCD_REPORT_PRESCALER(&report, i),
+				ucd_clock_map(&clock, report.stamp[i], now));
+		}
+		fflush(stdout);
+	}
+	return err;
+}
+
 int do_command_feature_get(int fd)
 {
 	int report_id = 0;
@@ -333,10 +650,10 @@ int do_command_feature_get(int fd)
 		}
 	}
 
-	int err = hiddev_get_feature_report(fd, report_id, buf, sizeof(buf));
+	int err = g_backend->get_feature_report(fd, report_id, buf, sizeof(buf));
 	if ( err < 0 )
 	{
-		ERR("hiddev_get_feature_report failure %d", err);
+		ERR("get_feature_report failure %d", err);
 		return err;
 	}
 
@@ -366,159 +683,673 @@ int do_command_feature_set(int fd)
 		buf[num_extra_args] = strtoul(ARGV_[num_extra_args],0,0);
 	pretty_print_buffer(buf, num_extra_args);
 
-	err = hiddev_set_feature_report(fd, report_id, buf, num_extra_args);
+	err = g_backend->set_feature_report(fd, report_id, buf, num_extra_args);
 	if ( err < 0 )
 	{
-		ERR("hiddev_set_feature_report failure %d", err);
+		ERR("set_feature_report failure %d", err);
 		return err;
 	}
 	return err;
 }
 
-int do_command(char const *device)
+int do_command_params(int fd)
 {
-	int err;
-	int fd = -1;
-	if ( (fd=open(device, O_RDONLY)) == -1 )
+	ucd_parameters_request_type params;
+	int err = ucd_get_subrq(fd, UCD_SUBRQ_PARAMETERS, &params, sizeof(params));
+	if ( err < 0 )
 	{
-		err = -errno;
-		ERR("failed to open device %s: %d", device, err);
-		goto exit;
+		ERR("ucd_get_subrq failure %d", err);
+		return err;
 	}
 
-	struct hiddev_attr attrs;
-	err = hiddev_devinfo_fd(fd, &attrs);
-	if ( err < 0 )
+	int modified = 0;
+	int ch;
+	while ( (ch=getopt(ARGC_, ARGV_, "s:r:e:y:k:i:")) != -1 )
 	{
-		ERR("hiddev_devinfo failure %d for device %s", err, device);
-		goto exit_close;
+		switch ( ch )
+		{
+		case 's': params.sensitivity = strtol(optarg, 0, 0); break;
+		case 'r': params.report_interval = strtoul(optarg, 0, 0); break;
+		case 'e':
+			if ( !(g_caps.features & UCD_FEATURE_EVENT_MODE) )
+			{
+				ERR("event mode is not supported by the firmware");
+				return -ENOTSUP;
+			}
+			if ( strtoul(optarg, 0, 0) )
+				params.flags |= UCD_PARAM_FLAG_EVENT_MODE;
+			else
+				params.flags &= ~UCD_PARAM_FLAG_EVENT_MODE;
+			break;
+		case 'y': params.hysteresis_shift = strtoul(optarg, 0, 0); break;
+		case 'k': params.keepalive = strtoul(optarg, 0, 0); break;
+		case 'i':
+			if ( g_caps.channels < 2 )
+			{
+				ERR("IR compensation needs a multi-channel firmware");
+				return -ENOTSUP;
+			}
+			params.ir_weight = strtoul(optarg, 0, 0);
+			break;
+		default: return -EINVAL;
+		}
+		modified = 1;
 	}
 
-	/* ok, this is a working HID device */
-	MSG("Found a device:");
-	pretty_print_hid_attrs(&attrs,"\t");
+	if ( modified )
+	{
+		err = ucd_set_subrq(fd, UCD_SUBRQ_PARAMETERS, &params, sizeof(params));
+		if ( err < 0 )
+		{
+			ERR("ucd_set_subrq failure %d", err);
+			return err;
+		}
+	}
 
-	/* default command */
-	char *command = ARGV_[0];
-	if ( !command )
-		command = "getreport";
+	fprintf(stdout,
+		"sensitivity: %d\n"
+		"flags: 0x%04x\n"
+		"report interval: %u ms\n"
+		"event mode: %s\n"
+		"hysteresis: 1/%u\n"
+		"keepalive: %u ms\n",
+		params.sensitivity, params.flags, params.report_interval,
+		(params.flags & UCD_PARAM_FLAG_EVENT_MODE) ? "on" : "off",
+		1u << (params.hysteresis_shift & 0x0F), params.keepalive);
+	if ( g_caps.channels > 1 )
+		fprintf(stdout, "IR weight: %u/256\n", params.ir_weight);
+	return 0;
+}
 
-	if ( ! strcmp(command,"getreport") )
+int do_command_history(int fd)
+{
+	if ( !(g_caps.features & UCD_FEATURE_HISTORY) )
 	{
-		err = do_command_getreport(fd);
+		ERR("history is not supported by the firmware");
+		return -ENOTSUP;
 	}
-	else if ( ! strcmp(command, "getfeature") )
+
+	ucd_history_report_type history;
+	int err = g_backend->get_feature_report(fd, UCD_SUBRQ_HISTORY_REPORT_ID,
+					    (uint8_t *)&history, sizeof(history));
+	if ( err < 0 )
 	{
-		err = do_command_feature_get(fd);
+		ERR("get_feature_report failure %d", err);
+		return err;
 	}
-	else if ( ! strcmp(command, "setfeature") )
+
+	uint16_t values[UCD_HISTORY_SIZE + 1];
+	const unsigned int count = ucd_history_decode(&history, values, sizeof(values)/sizeof(values[0]));
+	MSG("%u of %u values, %u ms apart", count, history.samples, history.period);
+
+	/* oldest first, time relative to the newest */
+	for(unsigned int i = count; i--; )
+		fprintf(stdout, "%8.3f %u\n", -(double)i * history.period / 1000, values[i]);
+	return 0;
+}
+
+int do_command_stats(int fd)
+{
+	if ( !(g_caps.features & UCD_FEATURE_STATS) )
 	{
-		err = do_command_feature_set(fd);
+		ERR("statistics are not supported by the firmware");
+		return -ENOTSUP;
 	}
-	else if ( !strcmp(command,"info") )
+
+	unsigned int interval = 1;
+	unsigned int count = 0;
+	int reset = 0;
+
+	int ch;
+	while ( (ch=getopt(ARGC_, ARGV_, "t:n:r")) != -1 )
 	{
-		err = do_command_info(fd);
+		switch ( ch )
+		{
+		case 't':
+			interval = strtoul(optarg, 0, 0);
+			if ( !interval ) return -EINVAL;
+			break;
+		case 'n': count = strtoul(optarg, 0, 0); break;
+		case 'r': reset = 1; break;
+		default: return -EINVAL;
+		}
 	}
-	else if ( !strcmp(command, "monitor") )
+
+	ucd_stats_request_type prev, cur;
+	int err;
+	if ( reset )
 	{
-		err = do_command_monitor(fd);
+		/* any write clears the peaks */
+		memset(&cur, 0, sizeof(cur));
+		err = ucd_set_subrq(fd, UCD_SUBRQ_STATS, &cur, sizeof(cur));
+		if ( err < 0 )
+		{
+			ERR("ucd_set_subrq failure %d", err);
+			return err;
+		}
 	}
-	else if ( !strcmp(command, "sample") )
+	err = ucd_get_subrq(fd, UCD_SUBRQ_STATS, &prev, sizeof(prev));
+	if ( err < 0 )
 	{
-		err = do_command_sample(fd);
+		ERR("ucd_get_subrq failure %d", err);
+		return err;
 	}
-	else
+	MSG("reset cause: 0x%02x, %s start", prev.reset_cause & ~UCD_RESET_WARM,
+	    prev.reset_cause & UCD_RESET_WARM ? "warm" : "cold");
+
+	for(unsigned int n = 0; !count || n != count; ++n)
 	{
-		ERR("Bad command '%s'", command);
-		goto exit_close;
-	}
-	
-exit_close:
-	close(fd);
+		sleep(interval);
+		err = ucd_get_subrq(fd, UCD_SUBRQ_STATS, &cur, sizeof(cur));
+		if ( err < 0 )
+		{
+			ERR("ucd_get_subrq failure %d", err);
+			return err;
+		}
+		ucd_prescaler_hits_request_type hits;
+		err = ucd_get_subrq(fd, UCD_SUBRQ_PRESCALER_HITS, &hits, sizeof(hits));
+		if ( err < 0 )
+		{
+			ERR("ucd_get_subrq failure %d", err);
+			return err;
+		}
 
-exit:
-	return err;
+		/* counters are 16 bit and wrap */
+		const double max_loop = (cur.max_loop >> 8)
+			+ (cur.tick_counts ? (double)(cur.max_loop & 0xFF) / cur.tick_counts : 0);
+		fprintf(stdout,
+			"samples/s: %.1f (device: %u) overflows: %u underflows: %u "
+			"reports/s: %.1f eeprom pending: %u max loop: %.2f ms\n",
+			(double)(uint16_t)(cur.samples - prev.samples) / interval,
+			cur.sample_rate,
+			(uint16_t)(cur.overflows - prev.overflows),
+			(uint16_t)(cur.underflows - prev.underflows),
+			(double)(uint16_t)(cur.reports - prev.reports) / interval,
+			cur.eeprom_pending, max_loop);
+
+		unsigned int total = 0;
+		for(unsigned int i = 0; i != UCD_PRESCALER_COUNT; ++i)
+			total += hits.hits[i];
+		fprintf(stdout, "prescaler hits:");
+		for(unsigned int i = 0; i != UCD_PRESCALER_COUNT; ++i)
+			if ( hits.hits[i] )
+				fprintf(stdout, " %u:%u%%", i + 1, 100 * hits.hits[i] / total);
+		fprintf(stdout, "\n");
+		fflush(stdout);
+		prev = cur;
+	}
+	return 0;
 }
 
-int main(int argc, char **argv)
+int do_command_profile(int fd)
 {
-	int err;
-	int ch;
-	char const *directory = devusb_dir_default;
-	char const *device = 0;
+	static const char * const stage_names[UCD_PROFILE_STAGES] = {
+		[UCD_PROFILE_USB_POLL] = "usbPoll",
+		[UCD_PROFILE_REPORT_SEND] = "report send",
+		[UCD_PROFILE_SAMPLER_POLL] = "sampler poll",
+		[UCD_PROFILE_FP_INVERSE] = "fp_inverse",
+		[UCD_PROFILE_FILTER] = "filter",
+		[UCD_PROFILE_CAPTURE_ISR] = "capture isr",
+		[UCD_PROFILE_OVERFLOW_ISR] = "overflow isr",
+	};
 
-	ARGC_ = argc;
-	ARGV_ = argv;
+	if ( !(g_caps.features & UCD_FEATURE_PROFILE) )
+	{
+		ERR("profiling is not supported by the firmware");
+		return -ENOTSUP;
+	}
 
-	while( (ch=getopt(argc, argv, "d:D:v")) != -1 )
+	int reset = 0;
+	unsigned int prescaler = 0;
+
+	int ch;
+	while ( (ch=getopt(ARGC_, ARGV_, "rp:")) != -1 )
 	{
 		switch ( ch )
 		{
-		case 'd':
-			device = optarg;
-			break;
-		case 'D':
-			directory = optarg;
-			break;
-		default:
+		case 'r': reset = 1; break;
+		case 'p':
+			prescaler = strtoul(optarg, 0, 0);
+			if ( prescaler > UCD_PRESCALER_COUNT ) return -EINVAL;
+			reset = 1;
 			break;
+		default: return -EINVAL;
 		}
 	}
 
-	if ( !device )
+	ucd_profile_request_type pr;
+	int err;
+	if ( reset )
 	{
-		if ( !directory || directory[0] == '\0' )
-		{
-			ERR("invalid directory specification");
-			exit(EXIT_FAILURE);
-		}
+		/* any stage write clears them all */
+		memset(&pr, 0, sizeof(pr));
+		pr.prescaler = prescaler;
+		err = ucd_set_subrq(fd, UCD_SUBRQ_PROFILE_0, &pr, sizeof(pr));
+		if ( err < 0 )
+			ERR("ucd_set_subrq failure %d", err);
+		return err;
+	}
 
-		struct hiddev_attr search_attr;
-		search_attr.validity_mask = HID_VID_VALID | HID_PID_VALID;
-		search_attr.device_info.vendor = DEFAULT_VID;
-		search_attr.device_info.product = DEFAULT_PID;
-		err = hiddev_find_device(directory, &device, &search_attr);
+	/* times in timer counts, cycles are count_cycles apart */
+	fprintf(stdout, "%-14s %6s %8s %8s %8s\n", "stage", "runs", "min", "avg", "max");
+	for(unsigned int i = 0; i != UCD_PROFILE_STAGES; ++i)
+	{
+		err = ucd_get_subrq(fd, UCD_SUBRQ_PROFILE_0 + i, &pr, sizeof(pr));
 		if ( err < 0 )
 		{
-			ERR("find device failed %d",err);
-			exit(EXIT_FAILURE);
+			ERR("ucd_get_subrq failure %d", err);
+			return err;
 		}
-		if ( err == 0 )
+		if ( !pr.runs )
 		{
-			ERR("no suitable devices found");
-			exit(EXIT_FAILURE);
+			fprintf(stdout, "%-14s %6u\n", stage_names[i], 0);
+			continue;
 		}
+		fprintf(stdout, "%-14s %6u %8u %8.0f %8u\n", stage_names[i], pr.runs,
+			pr.min * pr.count_cycles,
+			(double)pr.total * pr.count_cycles / pr.runs,
+			pr.max * pr.count_cycles);
 	}
-
-	/* still no device */
-	if ( !device )
-	{
-		ERR("could not obtain device name (weird)");
-		exit(EXIT_FAILURE);
-	}
-
-	char *cmd;
-	cmd = shift_argv_n(optind);
-	DBG("Running command %s", cmd);
-	err = do_command(device);
-	if ( err < 0 )
-		exit(EXIT_FAILURE);
+	if ( pr.prescaler )
+		MSG("recorded at prescaler %u only", pr.prescaler);
+	MSG("cycles, %u cycle resolution, interrupts included", pr.count_cycles);
 	return 0;
 }
 
-
 /*
- *
- * HID device functions
- *
+ * Raw captures come from endpoint 3 on an interface of their own,
+ * read through usbfs while hiddev keeps the filtered stream
  */
-
-
-int hiddev_devinfo_fd(int fd, struct hiddev_attr *attrs)
+int do_command_raw(int fd)
 {
-	attrs->validity_mask = 0;
+	if ( !(g_caps.features & UCD_FEATURE_RAW_STREAM) )
+	{
+		ERR("raw stream is not supported by the firmware");
+		return -ENOTSUP;
+	}
+	if ( g_usbfd < 0 )
+	{
+		ERR("raw stream needs usbfs access");
+		return -ENODEV;
+	}
 
-	if ( -1 == ioctl(fd, HIDIOCGNAME(sizeof(attrs->devname)), &attrs->devname) )
+	unsigned int interface = UCD_RAW_INTERFACE;
+	if ( ioctl(g_usbfd, USBDEVFS_CLAIMINTERFACE, &interface) == -1 )
+	{
+		const int err = -errno;
+		ERR("USBDEVFS_CLAIMINTERFACE (%s)", strerror(errno));
+		return err;
+	}
+
+	int err = 0;
+	int synced = 0;
+	uint8_t next_seq = 0;
+	for(;;)
+	{
+		ucd_raw_capture_type cap;
+		struct usbdevfs_bulktransfer xfer = {
+			.ep = UCD_RAW_ENDPOINT,
+			.len = sizeof(cap),
+			.timeout = USBDEV_TIMEOUT_MS,
+			.data = &cap,
+		};
+		const int r = ioctl(g_usbfd, USBDEVFS_BULK, &xfer);
+		if ( r < 0 && ETIMEDOUT == errno )
+			continue; /* slow captures in the dark */
+		if ( r < 0 )
+		{
+			err = -errno;
+			ERR("USBDEVFS_BULK (%s)", strerror(errno));
+			break;
+		}
+		if ( r != sizeof(cap) )
+			continue;
+
+		if ( synced && cap.seq != next_seq )
+			WARN("lost %u captures", (uint8_t)(cap.seq - next_seq));
+		next_seq = cap.seq + 1;
+		synced = 1;
+		fprintf(stdout, "%3u %5u ch%u %2u %3u %c%c %5u\n",
+			cap.seq, cap.stamp, UCD_RAW_CHANNEL(cap.flags), cap.prescaler, cap.value,
+			cap.flags & UCD_RAW_FLAG_OVERFLOW ? 'o' : '-',
+			cap.flags & UCD_RAW_FLAG_UNDERFLOW ? 'u' : '-',
+			cap.filtered);
+		fflush(stdout);
+	}
+
+	ioctl(g_usbfd, USBDEVFS_RELEASEINTERFACE, &interface);
+	return err;
+}
+
+int do_command_dump(int fd)
+{
+	static const uint8_t subrq_ids[] = {
+		UCD_SUBRQ_PARAMETERS,
+		UCD_SUBRQ_CALIBRATION_SET_0, UCD_SUBRQ_CALIBRATION_SET_1,
+		UCD_SUBRQ_CALIBRATION_SET_2, UCD_SUBRQ_CALIBRATION_SET_3,
+		UCD_SUBRQ_CALIBRATION_SET_4, UCD_SUBRQ_CALIBRATION_SET_5,
+		UCD_SUBRQ_CALIBRATION_SET_6, UCD_SUBRQ_CALIBRATION_SET_7,
+	};
+	uint8_t buf[UCD_FEATURE_REPORT_COUNT];
+	struct timespec t_st, t_end;
+
+	clock_gettime(CLOCK_MONOTONIC, &t_st);
+	for(unsigned int i=0; i!=sizeof(subrq_ids); ++i)
+	{
+		int err = ucd_get_subrq(fd, subrq_ids[i], buf, sizeof(buf));
+		if ( err < 0 )
+		{
+			ERR("ucd_get_subrq failure %d for subrequest %02x", err, subrq_ids[i]);
+			return err;
+		}
+		fprintf(stdout, "subrequest %02x:\n", subrq_ids[i]);
+		pretty_print_buffer(buf, err);
+	}
+	clock_gettime(CLOCK_MONOTONIC, &t_end);
+
+	MSG("%zu subrequests in %.1f ms via %s", sizeof(subrq_ids),
+	    (t_end.tv_sec - t_st.tv_sec) * 1e3 + (t_end.tv_nsec - t_st.tv_nsec) / 1e6,
+	    g_usbfd >= 0 ? "vendor requests" : "feature reports");
+	return 0;
+}
+
+void bench_stat_add(struct bench_stat *stat, double t)
+{
+	if ( !stat->runs || t < stat->min ) stat->min = t;
+	if ( !stat->runs || t > stat->max ) stat->max = t;
+	stat->total += t;
+	stat->runs++;
+}
+
+/*
+ * Time feature report transactions through the selected backend,
+ * run once with each backend to compare them
+ */
+int do_command_bench(int fd)
+{
+	static const char * const names[] = { "set mux", "get data", "subrequest", "vendor get" };
+	struct bench_stat stats[4];
+	unsigned int count = 100;
+
+	int ch;
+	while ( (ch=getopt(ARGC_, ARGV_, "n:")) != -1 )
+	{
+		switch ( ch )
+		{
+		case 'n':
+			count = strtoul(optarg, 0, 0);
+			if ( !count ) return -EINVAL;
+			break;
+		default: return -EINVAL;
+		}
+	}
+
+	memset(stats, 0, sizeof(stats));
+	for(unsigned int n = 0; n != count; ++n)
+	{
+		ucd_mux_request_type mux = { .subrq_id = UCD_SUBRQ_CAPS };
+		uint8_t data[UCD_FEATURE_REPORT_COUNT];
+
+		const double t0 = monotonic_now();
+		int err = g_backend->set_feature_report(fd, UCD_SUBRQ_MUX_REPORT_ID, (uint8_t *)&mux, sizeof(mux));
+		if ( err < 0 )
+		{
+			ERR("set_feature_report failure %d", err);
+			return err;
+		}
+		const double t1 = monotonic_now();
+		err = g_backend->get_feature_report(fd, UCD_SUBRQ_DATA_REPORT_ID, data, sizeof(data));
+		if ( err < 0 )
+		{
+			ERR("get_feature_report failure %d", err);
+			return err;
+		}
+		const double t2 = monotonic_now();
+		bench_stat_add(&stats[0], t1 - t0);
+		bench_stat_add(&stats[1], t2 - t1);
+		bench_stat_add(&stats[2], t2 - t0);
+
+		/* the path the backends are both bypassed by, for reference */
+		if ( g_usbfd >= 0 && ucd_vendor_get(g_usbfd, UCD_SUBRQ_CAPS, data, sizeof(data)) > 0 )
+			bench_stat_add(&stats[3], monotonic_now() - t2);
+	}
+
+	fprintf(stdout, "%-12s %6s %8s %8s %8s\n", "transaction", "runs", "min", "avg", "max");
+	for(unsigned int i = 0; i != sizeof(stats)/sizeof(stats[0]); ++i)
+	{
+		if ( !stats[i].runs )
+			continue;
+		fprintf(stdout, "%-12s %6u %8.0f %8.0f %8.0f\n", names[i], stats[i].runs,
+			stats[i].min * 1e6, stats[i].total / stats[i].runs * 1e6, stats[i].max * 1e6);
+	}
+	MSG("%s backend, microseconds per transaction", g_backend->name);
+	return 0;
+}
+
+int do_command(char const *device)
+{
+	int err;
+	int fd = -1;
+	if ( (fd=open(device, g_backend->open_flags)) == -1 )
+	{
+		err = -errno;
+		ERR("failed to open device %s: %d", device, err);
+		goto exit;
+	}
+
+	struct hiddev_attr attrs;
+	err = g_backend->devinfo_fd(fd, &attrs);
+	if ( err < 0 )
+	{
+		ERR("%s devinfo failure %d for device %s", g_backend->name, err, device);
+		goto exit_close;
+	}
+
+	/* ok, this is a working HID device */
+	MSG("Found a device:");
+	pretty_print_hid_attrs(&attrs,"\t");
+
+	/* vendor requests go around hiddev, through usbfs */
+	g_usbfd = -ENODEV;
+	if ( (attrs.validity_mask & (HID_BUSNUM_VALID | HID_DEVNUM_VALID))
+	     == (HID_BUSNUM_VALID | HID_DEVNUM_VALID) )
+		g_usbfd = usbdev_open(&attrs);
+	if ( g_usbfd < 0 )
+		DBG("usbfs is not available (%d), using feature reports", g_usbfd);
+
+	/* capabilities decide which paths to use from now on */
+	err = ucd_caps_read(fd, &g_caps);
+	if ( err < 0 )
+	{
+		ERR("ucd_caps_read failure %d", err);
+		goto exit_close;
+	}
+
+	/* default command */
+	char *command = ARGV_[0];
+	if ( !command )
+		command = "getreport";
+
+	if ( ! strcmp(command,"getreport") )
+	{
+		err = do_command_getreport(fd);
+	}
+	else if ( ! strcmp(command, "getfeature") )
+	{
+		err = do_command_feature_get(fd);
+	}
+	else if ( ! strcmp(command, "setfeature") )
+	{
+		err = do_command_feature_set(fd);
+	}
+	else if ( !strcmp(command,"info") )
+	{
+		err = do_command_info(fd);
+	}
+	else if ( !strcmp(command, "monitor") )
+	{
+		err = do_command_monitor(fd);
+	}
+	else if ( !strcmp(command, "sample") )
+	{
+		err = do_command_sample(fd);
+	}
+	else if ( !strcmp(command, "stream") )
+	{
+		err = do_command_stream(fd);
+	}
+	else if ( !strcmp(command, "params") )
+	{
+		err = do_command_params(fd);
+	}
+	else if ( !strcmp(command, "history") )
+	{
+		err = do_command_history(fd);
+	}
+	else if ( !strcmp(command, "stats") )
+	{
+		err = do_command_stats(fd);
+	}
+	else if ( !strcmp(command, "profile") )
+	{
+		err = do_command_profile(fd);
+	}
+	else if ( !strcmp(command, "raw") )
+	{
+		err = do_command_raw(fd);
+	}
+	else if ( !strcmp(command, "dump") )
+	{
+		err = do_command_dump(fd);
+	}
+	else if ( !strcmp(command, "bench") )
+	{
+		err = do_command_bench(fd);
+	}
+	else
+	{
+		ERR("Bad command '%s'", command);
+		goto exit_close;
+	}
+	
+exit_close:
+	if ( g_usbfd >= 0 )
+		close(g_usbfd);
+	close(fd);
+
+exit:
+	return err;
+}
+
+int main(int argc, char **argv)
+{
+	int err;
+	int ch;
+	char const *directory = 0;
+	char const *device = 0;
+
+	ARGC_ = argc;
+	ARGV_ = argv;
+
+	while( (ch=getopt(argc, argv, "+b:d:D:s:v")) != -1 )
+	{
+		switch ( ch )
+		{
+		case 's':
+			g_report_deadline_ms = strtol(optarg, 0, 0);
+			if ( g_report_deadline_ms < 0 )
+			{
+				ERR("invalid silence deadline %s", optarg);
+				exit(EXIT_FAILURE);
+			}
+			break;
+		case 'b':
+			g_backend = hid_backend_find(optarg);
+			if ( !g_backend )
+			{
+				ERR("unknown backend '%s', use hiddev or hidraw", optarg);
+				exit(EXIT_FAILURE);
+			}
+			break;
+		case 'd':
+			device = optarg;
+			break;
+		case 'D':
+			directory = optarg;
+			break;
+		default:
+			break;
+		}
+	}
+
+	/* a device node given tells its flavour by name */
+	if ( !g_backend && device )
+	{
+		char const *base = strrchr(device, '/');
+		base = base ? base + 1 : device;
+		if ( !strncmp(base, "hidraw", 6) )
+			g_backend = hid_backend_find("hidraw");
+	}
+	if ( !g_backend )
+		g_backend = hid_backend_find("hiddev");
+	if ( !directory )
+		directory = g_backend->dir_default;
+
+	if ( !device )
+	{
+		if ( !directory || directory[0] == '\0' )
+		{
+			ERR("invalid directory specification");
+			exit(EXIT_FAILURE);
+		}
+
+		struct hiddev_attr search_attr;
+		search_attr.validity_mask = HID_VID_VALID | HID_PID_VALID;
+		search_attr.device_info.vendor = DEFAULT_VID;
+		search_attr.device_info.product = DEFAULT_PID;
+		err = hiddev_find_device(directory, &device, &search_attr);
+		if ( err < 0 )
+		{
+			ERR("find device failed %d",err);
+			exit(EXIT_FAILURE);
+		}
+		if ( err == 0 )
+		{
+			ERR("no suitable devices found");
+			exit(EXIT_FAILURE);
+		}
+	}
+
+	/* still no device */
+	if ( !device )
+	{
+		ERR("could not obtain device name (weird)");
+		exit(EXIT_FAILURE);
+	}
+
+	char *cmd;
+	cmd = shift_argv_n(optind);
+	optind = 0; /* commands parse their own options */
+	DBG("Running command %s", cmd);
+	err = do_command(device);
+	if ( err < 0 )
+		exit(EXIT_FAILURE);
+	return 0;
+}
+
+
+/*
+ *
+ * HID device functions
+ *
+ */
+
+
+int hiddev_devinfo_fd(int fd, struct hiddev_attr *attrs)
+{
+	attrs->validity_mask = 0;
+
+	if ( -1 == ioctl(fd, HIDIOCGNAME(sizeof(attrs->devname)), &attrs->devname) )
 		return -errno;
 
 	attrs->validity_mask |= HID_DEVNAME_VALID;
@@ -534,10 +1365,10 @@ int hiddev_devinfo_fd(int fd, struct hiddev_attr *attrs)
 int hiddev_devinfo(char const *name, struct hiddev_attr *attrs)
 {
 	int fd;
-	if ( (fd=open(name, O_RDONLY)) == -1 )
+	if ( (fd=open(name, g_backend->open_flags)) == -1 )
 		return -errno;
 
-	int r = hiddev_devinfo_fd(fd, attrs);
+	int r = g_backend->devinfo_fd(fd, attrs);
 
 	close(fd);
 	return r;
@@ -627,6 +1458,7 @@ int hiddev_find_device(char const *dirspec, char const **result, struct hiddev_a
 		}
 		DBG("entry '%s' %c%c", entry->d_name, (isblk ? 'B' : ' '), (ischr ? 'C' : ' ') );
 		if ( !isblk && !ischr ) continue;
+		if ( strncmp(entry->d_name, g_backend->node_prefix, strlen(g_backend->node_prefix)) ) continue;
 
 		/* construct a device name and try to initialize */
 		char *name_buf = concat_(dirspec, entry->d_name);
@@ -670,61 +1502,233 @@ exit:
 	return err;
 }
 
+int hiddev_report_info(int fd)
+{
+	do_report_info(fd, HID_REPORT_TYPE_INPUT);
+	do_report_info(fd, HID_REPORT_TYPE_OUTPUT);
+	do_report_info(fd, HID_REPORT_TYPE_FEATURE);
+	return 0;
+}
+
+/*
+ * Read the whole input report.
+ *
+ * hiddev delivers one record per usage, each with its field and
+ * usage index, so values land in place whatever order they come in.
+ * The report closing record hands over the report once all usages are in.
+ */
 // http://google.com/codesearch/p?hl=ru#NFsuUs6GhVY/src/hiddev.c&q=HID_REPORT_TYPE_FEATURE&sa=N&cd=60&ct=rc
 int hiddev_get_report(int fd, uint8_t *buf, size_t buf_size)
 {
+	enum
+	{
+		SEEN_SAMPLE = UCD_INPUT_HEADER_SIZE,
+		SEEN_STAMP = UCD_INPUT_HEADER_SIZE + UCD_INPUT_BATCH_SIZE,
+		SEEN_ALL = (1u << (UCD_INPUT_HEADER_SIZE + 2*UCD_INPUT_BATCH_SIZE)) - 1,
+	};
 	int err;
-	struct hiddev_event event;
+	ucd_input_report_type report;
+	uint8_t * const header = (uint8_t *)&report;
+	unsigned int seen = 0; /* bit per usage received for the current report */
 	struct hiddev_report_info rinfo = {
 		.report_type = HID_REPORT_TYPE_INPUT,
 		.report_id = HID_REPORT_ID_FIRST,
-		.num_fields = 2
+		.num_fields = 3
 	};
-	
-	fd_set rfd;
-	struct timeval timeout;
-
-	FD_ZERO(&rfd);
-	FD_SET(fd, &rfd);
-	timeout.tv_sec = 0;
-	timeout.tv_usec = 500000L;
-	err = select(fd+1, &rfd, 0, 0, &timeout);
-	if ( err < 0 )
-	{
-		err = -errno;
-		goto exit;
-	}
-	if ( err > 0 && FD_ISSET(fd, &rfd) )
-		goto readnow;
-
-	/* timeout, ask the kernel to receive a report */
-	if ( ioctl(fd, HIDIOCGREPORT, &rinfo) == -1 )
-	{
-		err = -errno;
-		goto exit;
-	}
 
-readnow:
-	if ( (err = read(fd, &event, sizeof(event))) == -1 )
+	for(;;)
 	{
-		err = -errno;
-		goto exit;
-	}
-#if 0
-	DBG("got %d bytes of event data", err);
-	DBG("event.hid=%x", event.hid);
-	DBG("event.value=%x", event.value);
-#endif
+		err = hiddev_reader_fill(&g_reader, fd);
+		if ( err < 0 )
+			goto exit;
+		if ( err == 0 )
+		{
+			/* silent past the deadline, ask the kernel to receive a report.
+			 * usbhid queues usage events for it too, the same samples
+			 * come again from the event queue and only the seq dedup
+			 * in ucd_stream_update() keeps them from counting twice */
+			if ( ioctl(fd, HIDIOCGREPORT, &rinfo) == -1 )
+			{
+				err = -errno;
+				goto exit;
+			}
+			g_reader.last_event = monotonic_now();
+			err = hiddev_get_input_fields(fd, &report);
+			if ( err < 0 )
+				goto exit;
+			break;
+		}
 
-#ifndef min
-#define min(a,b) ( ((a)<(b))?(a):(b) )
-#endif
-	err = min(buf_size, sizeof(event.value));
-	memcpy(buf, &event.value, err);
+		struct hiddev_usage_ref const *uref = &g_reader.events[g_reader.head++];
+		if ( uref->report_type != HID_REPORT_TYPE_INPUT )
+			continue;
+		if ( uref->field_index == HID_FIELD_INDEX_NONE )
+		{
+			/* end of report, a partial one (joined mid report) is dropped */
+			if ( seen == SEEN_ALL )
+				break;
+			seen = 0;
+			continue;
+		}
+
+		const unsigned int i = uref->usage_index;
+		switch ( uref->usage_code & 0xFFFF )
+		{
+		case UCD_USAGE_HEADER:
+			if ( i < UCD_INPUT_HEADER_SIZE )
+			{
+				header[i] = uref->value;
+				seen |= 1u << i;
+			}
+			break;
+		case UCD_USAGE_SAMPLE:
+			if ( i < UCD_INPUT_BATCH_SIZE )
+			{
+				report.sample[i] = uref->value;
+				seen |= 1u << (SEEN_SAMPLE + i);
+			}
+			break;
+		case UCD_USAGE_STAMP:
+			if ( i < UCD_INPUT_BATCH_SIZE )
+			{
+				report.stamp[i] = uref->value;
+				seen |= 1u << (SEEN_STAMP + i);
+			}
+			break;
+		}
+	}
+
+	if ( report.count > UCD_INPUT_BATCH_SIZE )
+		report.count = UCD_INPUT_BATCH_SIZE;
+	err = min(buf_size, sizeof(report));
+	memcpy(buf, &report, err);
 exit:
 	return err;
 }
 
+/*
+ * Make records available, reading all the kernel has queued at once.
+ * The deadline runs from the last event, not from the call, so a steady
+ * stream never triggers GET_REPORT however the reports are consumed.
+ *
+ * \return >0 records available
+ *         =0 device silent past the deadline
+ *         <0 error
+ */
+int hiddev_reader_fill(struct hiddev_reader *reader, int fd)
+{
+	if ( reader->fd == fd && reader->head != reader->count )
+		return reader->count - reader->head;
+
+	if ( reader->fd != fd )
+	{
+		if ( reader->epfd >= 0 )
+			close(reader->epfd);
+		reader->fd = -1;
+		reader->epfd = epoll_create1(EPOLL_CLOEXEC);
+		if ( reader->epfd == -1 )
+			return -errno;
+		struct epoll_event ev = { .events = EPOLLIN, .data.fd = fd };
+		if ( epoll_ctl(reader->epfd, EPOLL_CTL_ADD, fd, &ev) == -1 )
+		{
+			int err = -errno;
+			close(reader->epfd);
+			reader->epfd = -1;
+			return err;
+		}
+		/* usage records with their indices, and a record closing each report */
+		int flags = HIDDEV_FLAG_UREF | HIDDEV_FLAG_REPORT;
+		if ( ioctl(fd, HIDIOCSFLAG, &flags) == -1 )
+		{
+			int err = -errno;
+			ERR("HIDIOCSFLAG (%s)", strerror(errno));
+			close(reader->epfd);
+			reader->epfd = -1;
+			return err;
+		}
+		reader->fd = fd;
+		reader->last_event = monotonic_now();
+	}
+	reader->head = reader->count = 0;
+
+	struct epoll_event ev;
+	int r;
+	do
+		r = epoll_wait(reader->epfd, &ev, 1, report_wait_ms(reader->last_event));
+	while ( r == -1 && EINTR == errno );
+	if ( r == -1 )
+		return -errno;
+	if ( r == 0 )
+		return 0;
+
+	const ssize_t len = read(fd, reader->events, sizeof(reader->events));
+	if ( len == -1 )
+		return -errno;
+	if ( len == 0 )
+		return -ENODEV;
+	reader->count = len / sizeof(reader->events[0]);
+	reader->last_event = monotonic_now();
+	return reader->count;
+}
+
+/*
+ * epoll/poll timeout until the silence deadline, -1 - no deadline
+ */
+int report_wait_ms(double last_event)
+{
+	if ( !g_report_deadline_ms )
+		return -1;
+	const double left = last_event + g_report_deadline_ms * 1e-3 - monotonic_now();
+	return left > 0 ? (int)(left * 1e3) + 1 : 0;
+}
+
+/*
+ * Fetch the last input report cached by the kernel
+ */
+int hiddev_get_input_fields(int fd, ucd_input_report_type *report)
+{
+	struct hiddev_usage_ref_multi ref_multi_i = {
+		.uref = {
+			.report_type = HID_REPORT_TYPE_INPUT,
+			.report_id = 0,
+			.field_index = 0,
+			.usage_index = 0,
+		},
+		.num_values = UCD_INPUT_HEADER_SIZE,
+	};
+	if ( ioctl(fd, HIDIOCGUSAGES, &ref_multi_i) != 0 )
+	{
+		int err = -errno;
+		ERR("HIDIOCGUSAGES (%s)", strerror(errno));
+		return err;
+	}
+	for(int i=0; i!=UCD_INPUT_HEADER_SIZE; ++i)
+		((uint8_t *)report)[i] = ref_multi_i.values[i];
+
+	ref_multi_i.uref.field_index = 1;
+	ref_multi_i.num_values = UCD_INPUT_BATCH_SIZE;
+	if ( ioctl(fd, HIDIOCGUSAGES, &ref_multi_i) != 0 )
+	{
+		int err = -errno;
+		ERR("HIDIOCGUSAGES (%s)", strerror(errno));
+		return err;
+	}
+	for(int i=0; i!=UCD_INPUT_BATCH_SIZE; ++i)
+		report->sample[i] = ref_multi_i.values[i];
+
+	ref_multi_i.uref.field_index = 2;
+	if ( ioctl(fd, HIDIOCGUSAGES, &ref_multi_i) != 0 )
+	{
+		int err = -errno;
+		ERR("HIDIOCGUSAGES (%s)", strerror(errno));
+		return err;
+	}
+	for(int i=0; i!=UCD_INPUT_BATCH_SIZE; ++i)
+		report->stamp[i] = ref_multi_i.values[i];
+
+	return 0;
+}
+
 int hiddev_get_feature_report(int fd, int report_id, unsigned char *buffer, size_t length)
 {
 	struct hiddev_report_info rinfo;
@@ -840,6 +1844,725 @@ int hiddev_set_feature_report(int fd, int report_id, const unsigned char *buffer
 	return err;
 }
 
+/*
+ *
+ * HID raw device functions
+ *
+ */
+
+int hidraw_devinfo_fd(int fd, struct hiddev_attr *attrs)
+{
+	struct hidraw_devinfo info;
+	attrs->validity_mask = 0;
+	memset(&attrs->device_info, 0, sizeof(attrs->device_info));
+
+	if ( -1 == ioctl(fd, HIDIOCGRAWNAME(sizeof(attrs->devname)), &attrs->devname) )
+		return -errno;
+
+	attrs->validity_mask |= HID_DEVNAME_VALID;
+
+	if ( -1 == ioctl(fd, HIDIOCGRAWINFO, &info) )
+		return -errno;
+
+	attrs->device_info.bustype = info.bustype;
+	attrs->device_info.vendor = info.vendor;
+	attrs->device_info.product = info.product;
+	attrs->validity_mask |= ( HID_VID_VALID | HID_PID_VALID );
+
+	/* hidraw does not tell where the device is on the bus, sysfs does */
+	if ( hidraw_usb_location(fd, &attrs->device_info) == 0 )
+		attrs->validity_mask |= ( HID_BUSNUM_VALID | HID_DEVNUM_VALID );
+
+	return 0;
+}
+
+/*
+ * The hid device of a node sits below the USB interface,
+ * which sits below the USB device with busnum and devnum
+ */
+int hidraw_usb_location(int fd, struct hiddev_devinfo *info)
+{
+	static const char * const attr_names[] = { "busnum", "devnum" };
+	unsigned int values[2];
+	char name[PATH_MAX];
+	struct stat st;
+
+	if ( fstat(fd, &st) == -1 )
+		return -errno;
+	snprintf(name, sizeof(name), "/sys/dev/char/%u:%u/device", major(st.st_rdev), minor(st.st_rdev));
+	char *path = realpath(name, 0);
+	if ( !path )
+		return -errno;
+
+	int err = -ENODEV;
+	for(int i = 0; i != 2; ++i)
+	{
+		char *slash = strrchr(path, '/');
+		if ( !slash )
+			goto exit;
+		*slash = '\0';
+	}
+
+	for(int i = 0; i != 2; ++i)
+	{
+		snprintf(name, sizeof(name), "%s/%s", path, attr_names[i]);
+		FILE *f = fopen(name, "r");
+		if ( !f )
+		{
+			err = -errno;
+			goto exit;
+		}
+		const int n = fscanf(f, "%u", &values[i]);
+		fclose(f);
+		if ( n != 1 )
+			goto exit;
+	}
+
+	info->busnum = values[0];
+	info->devnum = values[1];
+	err = 0;
+exit:
+	free(path);
+	return err;
+}
+
+/*
+ * Read the whole input report, it arrives in one read() as sent.
+ * The input report has no report id, so there is no prefix to strip.
+ */
+int hidraw_get_report(int fd, uint8_t *buf, size_t buf_size)
+{
+	static int no_get_input; /* kernel before 5.11 */
+	uint8_t raw[1 + sizeof(ucd_input_report_type)];
+	ucd_input_report_type report;
+	int err;
+
+	/* hidraw takes no events through the reader, only its deadline */
+	if ( g_reader.fd != fd )
+	{
+		g_reader.fd = fd;
+		g_reader.last_event = monotonic_now();
+	}
+
+	for(;;)
+	{
+		struct pollfd pfd = { .fd = fd, .events = POLLIN };
+		err = poll(&pfd, 1, no_get_input ? -1 : report_wait_ms(g_reader.last_event));
+		if ( err < 0 && EINTR == errno )
+			continue;
+		if ( err < 0 )
+		{
+			err = -errno;
+			goto exit;
+		}
+		if ( err == 0 )
+		{
+			g_reader.last_event = monotonic_now();
+			/* timeout, GET_REPORT in one call, the id byte comes back first */
+			raw[0] = 0;
+			err = ioctl(fd, HIDIOCGINPUT(sizeof(raw)), raw);
+			if ( err == -1 && (ENOTTY == errno || EINVAL == errno) )
+			{
+				DBG("HIDIOCGINPUT is not supported, waiting for reports");
+				no_get_input = 1;
+				continue;
+			}
+			if ( err == -1 )
+			{
+				err = -errno;
+				ERR("HIDIOCGINPUT (%s)", strerror(errno));
+				goto exit;
+			}
+			err = err > 1 ? err - 1 : 0;
+			memset(&report, 0, sizeof(report));
+			memcpy(&report, raw + 1, min(err, sizeof(report)));
+			break;
+		}
+
+		if ( (err = read(fd, raw, sizeof(raw))) == -1 )
+		{
+			err = -errno;
+			goto exit;
+		}
+		g_reader.last_event = monotonic_now();
+		if ( err < UCD_INPUT_HEADER_SIZE )
+			continue;
+		memset(&report, 0, sizeof(report));
+		memcpy(&report, raw, min(err, sizeof(report)));
+		break;
+	}
+
+	if ( report.count > UCD_INPUT_BATCH_SIZE )
+		report.count = UCD_INPUT_BATCH_SIZE;
+	err = min(buf_size, sizeof(report));
+	memcpy(buf, &report, err);
+exit:
+	return err;
+}
+
+/*
+ * Feature reports travel with the report id in front,
+ * one ioctl does the whole GET_REPORT or SET_REPORT
+ */
+int hidraw_get_feature_report(int fd, int report_id, unsigned char *buffer, size_t length)
+{
+	uint8_t raw[1 + 256];
+	const size_t raw_size = 1 + min(length, sizeof(raw) - 1);
+
+	raw[0] = report_id;
+	int r = ioctl(fd, HIDIOCGFEATURE(raw_size), raw);
+	if ( r < 0 )
+	{
+		int err = -errno;
+		ERR("HIDIOCGFEATURE (%s)", strerror(errno));
+		return err;
+	}
+	if ( r < 1 )
+		return -EIO;
+
+	memcpy(buffer, raw + 1, r - 1);
+	DBG("report length %d", r - 1);
+	return r - 1;
+}
+
+int hidraw_set_feature_report(int fd, int report_id, const unsigned char *buffer, size_t length)
+{
+	uint8_t raw[1 + 256];
+
+	if ( length > sizeof(raw) - 1 )
+		return -ENOMEM;
+	raw[0] = report_id;
+	memcpy(raw + 1, buffer, length);
+	if ( ioctl(fd, HIDIOCSFEATURE(1 + length), raw) < 0 )
+	{
+		int err = -errno;
+		ERR("HIDIOCSFEATURE (%s)", strerror(errno));
+		return err;
+	}
+	DBG("report ok");
+	return 0;
+}
+
+/* hidraw knows no fields, the report descriptor tells it all */
+int hidraw_report_info(int fd)
+{
+	struct hidraw_report_descriptor desc;
+
+	if ( ioctl(fd, HIDIOCGRDESCSIZE, &desc.size) == -1 )
+	{
+		int err = -errno;
+		ERR("HIDIOCGRDESCSIZE (%s)", strerror(errno));
+		return err;
+	}
+	if ( ioctl(fd, HIDIOCGRDESC, &desc) == -1 )
+	{
+		int err = -errno;
+		ERR("HIDIOCGRDESC (%s)", strerror(errno));
+		return err;
+	}
+	MSG("Report descriptor, %u bytes", desc.size);
+	pretty_print_buffer(desc.value, desc.size);
+	return 0;
+}
+
+static const struct hid_backend hid_backends[] = {
+	{
+		.name = "hiddev",
+		.dir_default = devusb_dir_default,
+		.node_prefix = "hiddev",
+		.open_flags = O_RDONLY,
+		.devinfo_fd = hiddev_devinfo_fd,
+		.init_report = hiddev_init_report,
+		.get_report = hiddev_get_report,
+		.get_feature_report = hiddev_get_feature_report,
+		.set_feature_report = hiddev_set_feature_report,
+		.report_info = hiddev_report_info,
+	},
+	{
+		.name = "hidraw",
+		.dir_default = dev_dir_default,
+		.node_prefix = "hidraw",
+		.open_flags = O_RDWR,
+		.devinfo_fd = hidraw_devinfo_fd,
+		.init_report = 0,
+		.get_report = hidraw_get_report,
+		.get_feature_report = hidraw_get_feature_report,
+		.set_feature_report = hidraw_set_feature_report,
+		.report_info = hidraw_report_info,
+	},
+};
+
+struct hid_backend const *hid_backend_find(char const *name)
+{
+	for(unsigned int i = 0; i != sizeof(hid_backends)/sizeof(hid_backends[0]); ++i)
+		if ( !strcmp(hid_backends[i].name, name) )
+			return &hid_backends[i];
+	return 0;
+}
+
+/*
+ *
+ * uCandela subrequest functions
+ *
+ */
+
+/*
+ * Read subrequest data in one vendor request if possible,
+ * otherwise select it with the mux report, then fetch the data report
+ */
+int ucd_get_subrq(int fd, uint8_t subrq_id, void *buffer, size_t length)
+{
+	ucd_mux_request_type mux = { .subrq_id = subrq_id };
+	uint8_t data[UCD_FEATURE_REPORT_COUNT];
+	int err;
+
+	if ( g_usbfd >= 0 )
+	{
+		err = ucd_vendor_get(g_usbfd, subrq_id, buffer, length);
+		if ( err > 0 )
+			return err;
+		WARN("vendor request failure %d, falling back to feature reports", err);
+		close(g_usbfd);
+		g_usbfd = -1;
+	}
+
+	err = g_backend->set_feature_report(fd, UCD_SUBRQ_MUX_REPORT_ID, (uint8_t *)&mux, sizeof(mux));
+	if ( err < 0 )
+		return err;
+
+	err = g_backend->get_feature_report(fd, UCD_SUBRQ_DATA_REPORT_ID, data, sizeof(data));
+	if ( err < 0 )
+		return err;
+
+	err = min(length, sizeof(data));
+	memcpy(buffer, data, err);
+	return err;
+}
+
+int ucd_set_subrq(int fd, uint8_t subrq_id, const void *buffer, size_t length)
+{
+	ucd_mux_request_type mux = { .subrq_id = subrq_id };
+	uint8_t data[UCD_FEATURE_REPORT_COUNT] = { 0 };
+	int err;
+
+	if ( length > sizeof(data) )
+		return -EINVAL;
+	memcpy(data, buffer, length);
+
+	if ( g_usbfd >= 0 )
+	{
+		err = ucd_vendor_set(g_usbfd, subrq_id, data, sizeof(data));
+		if ( err >= 0 )
+			return err;
+		WARN("vendor request failure %d, falling back to feature reports", err);
+		close(g_usbfd);
+		g_usbfd = -1;
+	}
+
+	err = g_backend->set_feature_report(fd, UCD_SUBRQ_MUX_REPORT_ID, (uint8_t *)&mux, sizeof(mux));
+	if ( err < 0 )
+		return err;
+
+	return g_backend->set_feature_report(fd, UCD_SUBRQ_DATA_REPORT_ID, data, sizeof(data));
+}
+
+/*
+ * Read device capabilities once, keep the vendor request path only
+ * if the firmware has it. Firmware without capabilities gets zeroes.
+ */
+int ucd_caps_read(int fd, ucd_caps_request_type *caps)
+{
+	int err = -ENODEV;
+	if ( g_usbfd >= 0 )
+		err = ucd_vendor_get(g_usbfd, UCD_SUBRQ_CAPS, caps, sizeof(*caps));
+	if ( err != sizeof(*caps) )
+	{
+		/* no vendor requests, ask through feature reports */
+		if ( g_usbfd >= 0 )
+			close(g_usbfd);
+		g_usbfd = -1;
+		err = ucd_get_subrq(fd, UCD_SUBRQ_CAPS, caps, sizeof(*caps));
+		if ( err < 0 )
+			return err;
+	}
+
+	if ( (caps->version >> 8) != (UCD_PROTOCOL_VERSION >> 8) )
+	{
+		WARN("firmware does not report capabilities, assuming the basics");
+		memset(caps, 0, sizeof(*caps));
+	}
+	if ( !(caps->features & UCD_FEATURE_VENDOR_RQ) && g_usbfd >= 0 )
+	{
+		close(g_usbfd);
+		g_usbfd = -1;
+	}
+	DBG("using %s for subrequests", g_usbfd >= 0 ? "vendor requests" : "feature reports");
+	return 0;
+}
+
+/*
+ * Open usbfs node of the device, the kernel lets vendor requests
+ * to the device recipient through while usbhid owns the interface
+ */
+int usbdev_open(struct hiddev_attr const *attrs)
+{
+	char name[sizeof(devbus_dir_default) + 16];
+	snprintf(name, sizeof(name), "%s/%03d/%03d", devbus_dir_default,
+		 attrs->device_info.busnum, attrs->device_info.devnum);
+
+	int ufd = open(name, O_RDWR);
+	if ( ufd == -1 )
+		return -errno;
+	return ufd;
+}
+
+int ucd_vendor_get(int ufd, uint8_t subrq_id, void *buffer, size_t length)
+{
+	struct usbdevfs_ctrltransfer ctrl = {
+		.bRequestType = USB_DIR_IN | USB_TYPE_VENDOR | USB_RECIP_DEVICE,
+		.bRequest = UCD_VENDOR_RQ_GET,
+		.wValue = subrq_id,
+		.wIndex = 0,
+		.wLength = min(length, UCD_FEATURE_REPORT_COUNT),
+		.timeout = USBDEV_TIMEOUT_MS,
+		.data = buffer,
+	};
+	int r = ioctl(ufd, USBDEVFS_CONTROL, &ctrl);
+	return r < 0 ? -errno : r;
+}
+
+int ucd_vendor_set(int ufd, uint8_t subrq_id, const void *buffer, size_t length)
+{
+	struct usbdevfs_ctrltransfer ctrl = {
+		.bRequestType = USB_DIR_OUT | USB_TYPE_VENDOR | USB_RECIP_DEVICE,
+		.bRequest = UCD_VENDOR_RQ_SET,
+		.wValue = subrq_id,
+		.wIndex = 0,
+		.wLength = min(length, UCD_FEATURE_REPORT_COUNT),
+		.timeout = USBDEV_TIMEOUT_MS,
+		.data = (void *)buffer,
+	};
+	int r = ioctl(ufd, USBDEVFS_CONTROL, &ctrl);
+	return r < 0 ? -errno : r;
+}
+
+/*
+ *
+ * Hook process functions
+ *
+ */
+
+int hook_start(struct hook *hook)
+{
+	int pipefd[2];
+	if ( pipe(pipefd) == -1 )
+		return -errno;
+
+	pid_t pid = fork();
+	if ( pid == -1 )
+	{
+		int err = -errno;
+		WARN("fork error %d", err);
+		close(pipefd[0]);
+		close(pipefd[1]);
+		return err;
+	}
+	if ( pid == 0 )
+	{
+		dup2(pipefd[0], STDIN_FILENO);
+		close(pipefd[0]);
+		close(pipefd[1]);
+		signal(SIGPIPE, SIG_DFL);
+		execl("/bin/sh", "/bin/sh", "-c", hook->command, (char *)0);
+		_exit(127);
+	}
+
+	close(pipefd[0]);
+	fcntl(pipefd[1], F_SETFL, O_NONBLOCK);
+	fcntl(pipefd[1], F_SETFD, FD_CLOEXEC);
+	/* the smallest pipe the kernel gives, stale values do not pile up */
+	fcntl(pipefd[1], F_SETPIPE_SZ, 0);
+	hook->fd = pipefd[1];
+	hook->pid = pid;
+	DBG("hook started, pid %d", (int)pid);
+	return 0;
+}
+
+/*
+ * Collect the hook process if it has exited, never waits for it
+ */
+void hook_reap(struct hook *hook)
+{
+	int status;
+	if ( !hook->pid || waitpid(hook->pid, &status, WNOHANG) <= 0 )
+		return;
+
+	if ( WIFEXITED(status) )
+		WARN("hook exited with status %d", WEXITSTATUS(status));
+	else if ( WIFSIGNALED(status) )
+		WARN("hook killed by signal %d", WTERMSIG(status));
+	hook->pid = 0;
+	if ( hook->fd >= 0 )
+		close(hook->fd);
+	hook->fd = -1;
+	hook->restart_at = monotonic_now() + HOOK_RESTART_DELAY;
+}
+
+/*
+ * \return >0 record written
+ *         =0 record dropped: hook behind or restarting
+ *         <0 error
+ */
+int hook_send(struct hook *hook, int value, double time)
+{
+	struct hook_record rec = { .seq = hook->seq++, .value = value, .time = time };
+	char text[48];
+	void const *buf = &rec;
+	size_t len = sizeof(rec);
+
+	hook_reap(hook);
+	if ( hook->pid && hook->fd < 0 )
+	{
+		/* still stopping, a hook ignoring SIGTERM does not stall reading */
+		if ( monotonic_now() >= hook->kill_at )
+		{
+			kill(hook->pid, SIGKILL);
+			hook->kill_at = monotonic_now() + HOOK_RESTART_DELAY;
+		}
+		goto dropped;
+	}
+	if ( !hook->pid )
+	{
+		if ( monotonic_now() < hook->restart_at )
+			goto dropped;
+		int err = hook_start(hook);
+		if ( err < 0 )
+		{
+			hook->restart_at = monotonic_now() + HOOK_RESTART_DELAY;
+			return err;
+		}
+		MSG("hook restarted (%u)", ++hook->restarts);
+	}
+
+	if ( HOOK_FORMAT_TEXT == hook->format )
+	{
+		len = snprintf(text, sizeof(text), "%d %.3f\n", value, time);
+		buf = text;
+	}
+
+	/* backpressure: hook has not taken what it was given yet */
+	int queued = 0;
+	if ( ioctl(hook->fd, FIONREAD, &queued) == 0 && queued + len > hook->depth * len )
+		goto dropped;
+
+	if ( write(hook->fd, buf, len) == -1 )
+	{
+		if ( EPIPE == errno )
+		{
+			/* stdin closed or hook gone, collected and restarted later */
+			kill(hook->pid, SIGTERM);
+			close(hook->fd);
+			hook->fd = -1;
+			hook->kill_at = monotonic_now() + HOOK_RESTART_DELAY;
+		}
+		else if ( EAGAIN != errno )
+		{
+			int err = -errno;
+			WARN("hook write error %d", err);
+			return err;
+		}
+		goto dropped;
+	}
+	return 1;
+
+dropped:
+	/* powers of two only, a slow hook does not flood the log */
+	hook->dropped++;
+	if ( !(hook->dropped & (hook->dropped - 1)) )
+		MSG("hook dropped %lu records", hook->dropped);
+	return 0;
+}
+
+/*
+ *
+ * Sample stream functions
+ *
+ */
+
+/*
+ * \return index of the first sample in the report not seen before,
+ *         samples skipped since the previous report are added to stream->lost
+ */
+unsigned int ucd_stream_update(struct ucd_stream *stream, ucd_input_report_type const *report)
+{
+	unsigned int first = 0;
+
+	if ( stream->synced )
+	{
+		const int8_t gap = report->seq - stream->next_seq;
+		if ( gap > 0 )
+			stream->lost += gap;
+		if ( gap < 0 ) /* repeated samples: GET_REPORT, and the hiddev events it queues */
+			first = min(-gap, report->count);
+	}
+
+	if ( first < report->count )
+	{
+		stream->next_seq = report->seq + report->count;
+		stream->synced = 1;
+	}
+	return first;
+}
+
+/*
+ *
+ * Device clock functions
+ *
+ */
+double monotonic_now(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+/*
+ * Stamps wrap every 65.536 s, a sample is taken shortly before host
+ * gets it, so pick the wrap nearest to the device time at host time
+ */
+int64_t ucd_clock_unwrap(struct ucd_clock const *clock, uint16_t stamp, double host)
+{
+	if ( !clock->synced )
+		return stamp;
+	const int64_t expected = (int64_t)((host - clock->offset) / (1.0 + clock->drift) * 1e3);
+	return expected + (int16_t)(stamp - (uint16_t)expected);
+}
+
+/*
+ * Feed a stamp received at host time, newest sample of a report is best
+ *
+ * \return the stamp unwrapped to device milliseconds
+ */
+int64_t ucd_clock_update(struct ucd_clock *clock, uint16_t stamp, double host)
+{
+	int64_t device_ms = ucd_clock_unwrap(clock, stamp, host);
+	double d = device_ms * 1e-3;
+
+	if ( clock->synced && host - d < clock->offset + clock->drift * d - UCD_CLOCK_JUMP )
+	{
+		DBG("device clock jumped, resync");
+		clock->synced = 0;
+		device_ms = stamp;
+		d = device_ms * 1e-3;
+	}
+	if ( !clock->synced )
+	{
+		clock->npoints = clock->head = 0;
+		clock->block_end = device_ms + UCD_CLOCK_BLOCK_MS;
+		clock->block_d = d;
+		clock->block_o = host - d;
+		clock->synced = 1;
+	}
+
+	if ( device_ms >= clock->block_end )
+	{
+		/* block closed, its minimum becomes a point of the fit */
+		clock->point_d[clock->head] = clock->block_d;
+		clock->point_o[clock->head] = clock->block_o;
+		clock->head = (clock->head + 1) % UCD_CLOCK_POINTS;
+		if ( clock->npoints < UCD_CLOCK_POINTS )
+			++clock->npoints;
+		clock->block_end = device_ms + UCD_CLOCK_BLOCK_MS;
+		clock->block_d = d;
+		clock->block_o = host - d;
+	}
+	else if ( host - d < clock->block_o )
+	{
+		clock->block_d = d;
+		clock->block_o = host - d;
+	}
+
+	ucd_clock_fit(clock);
+	return device_ms;
+}
+
+/*
+ * Least squares line through block minima,
+ * the block being collected stands in until the first one closes
+ */
+void ucd_clock_fit(struct ucd_clock *clock)
+{
+	if ( !clock->npoints )
+	{
+		clock->offset = clock->block_o;
+		clock->drift = 0;
+		return;
+	}
+
+	double md = 0, mo = 0;
+	for(unsigned int i = 0; i != clock->npoints; ++i)
+	{
+		md += clock->point_d[i];
+		mo += clock->point_o[i];
+	}
+	md /= clock->npoints;
+	mo /= clock->npoints;
+
+	double sxx = 0, sxy = 0;
+	for(unsigned int i = 0; i != clock->npoints; ++i)
+	{
+		sxx += (clock->point_d[i] - md) * (clock->point_d[i] - md);
+		sxy += (clock->point_d[i] - md) * (clock->point_o[i] - mo);
+	}
+	clock->drift = sxx > 0 ? sxy / sxx : 0;
+	clock->offset = mo - clock->drift * md;
+}
+
+/*
+ * \return host CLOCK_MONOTONIC seconds the sample with the stamp was taken at
+ */
+double ucd_clock_map(struct ucd_clock const *clock, uint16_t stamp, double host)
+{
+	const double d = ucd_clock_unwrap(clock, stamp, host) * 1e-3;
+	return d + clock->offset + clock->drift * d;
+}
+
+/*
+ * Decode history ring backwards from the newest value
+ *
+ * \return number of values stored, values[0] is the newest one
+ */
+unsigned int ucd_history_decode(ucd_history_report_type const *history, uint16_t *values, unsigned int max_values)
+{
+	unsigned int count = 0;
+	unsigned int pos = history->head % UCD_HISTORY_SIZE;
+	unsigned int left = min(history->fill, UCD_HISTORY_SIZE);
+	uint16_t value = history->last;
+
+#define PREV_BYTE() ( --left, pos = (pos ? pos : UCD_HISTORY_SIZE) - 1, history->ring[pos] )
+	if ( history->samples && max_values )
+		values[count++] = value;
+	while ( left && count < max_values && count < history->samples )
+	{
+		const uint8_t entry = PREV_BYTE();
+		if ( UCD_HISTORY_ESCAPE == entry )
+		{
+			if ( left < 2 )
+				break; /* older part of the entry is overwritten */
+			const uint8_t lo = PREV_BYTE();
+			const uint8_t hi = PREV_BYTE();
+			value = (hi << 8) | lo;
+		}
+		else
+		{
+			value -= (int8_t)entry;
+		}
+		values[count++] = value;
+	}
+#undef PREV_BYTE
+	return count;
+}
+
 /*
  *
  * Utility functions
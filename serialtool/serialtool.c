@@ -0,0 +1,1225 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <time.h>
+#include <signal.h>
+#include <fcntl.h>
+#include <termios.h>
+#include <poll.h>
+#include <sys/stat.h>
+#include <sys/ioctl.h>
+#include <sys/wait.h>
+#include "serial_api.h"
+#include "fplib.h"
+
+/*
+ * macros
+ */
+#define MSG_ERR 0
+#define MSG_WARN 1
+#define MSG_INFO 2
+#define MSG_DEBUG 3
+
+#define msg__(level, stream, fmt, ...) do { if ( (level) <= g_msglevel ) fprintf(stream, fmt "\n", ##__VA_ARGS__); } while (0)
+#ifndef NODEBUG
+#define DBG(fmt, ...) msg__(MSG_DEBUG, stderr, "%s:%d: " fmt, __FILE__, __LINE__, ##__VA_ARGS__)
+#else
+#define DBG(fmt, ...) ((void)0)
+#endif
+#define MSG(fmt, ...) msg__(MSG_INFO, stderr, fmt, ##__VA_ARGS__)
+#define WARN(fmt, ...) msg__(MSG_WARN, stderr, fmt, ##__VA_ARGS__)
+#define ERR(fmt, ...) msg__(MSG_ERR, stderr, fmt, ##__VA_ARGS__)
+
+#ifndef min
+#define min(a,b) ( ((a)<(b))?(a):(b) )
+#endif
+
+#define DEFAULT_TTY "/dev/ttyUSB0"
+#define DEFAULT_BAUD 115200 /* FEAT_BAUD of the firmware Makefile */
+#define DEFAULT_SAMPLE_PERIOD 1
+#define REOPEN_DELAY_US 1000000L
+#define READ_BUFFER_SIZE 4096
+#define HOOK_RESTART_DELAY 1.0 /* s between a hook exit and its restart */
+
+#ifndef F_SETPIPE_SZ
+#define F_SETPIPE_SZ 1031 /* linux, hidden behind _GNU_SOURCE */
+#endif
+
+/* what the firmware prints in text mode */
+#define TEXT_PREFIX "Light: "
+#define TEXT_LINE_MAX 64
+
+/*
+ * structures
+ */
+
+/* input formats */
+#define SERIAL_RX_TEXT 0x01 /* "Light: N" lines */
+#define SERIAL_RX_FRAMES 0x02 /* serial_api.h frames */
+
+/* one output of the device, whatever the format */
+struct serial_sample
+{
+	int has_seq; /* frames only */
+	uint8_t seq;
+	uint8_t prescaler;
+	uint8_t raw;
+	uint32_t level; /* as fp_to_uint32() */
+};
+
+typedef void (*serial_handler)(void *ctx, struct serial_sample const *sample);
+
+/*
+ * reassembly from the byte stream
+ * - a zero ends a frame, a newline ends a text line, both share the buffer
+ *   so that either format is recognized without being told
+ */
+struct serial_rx
+{
+	int formats;
+	int text_base; /* 10, 16 for firmware printing hex */
+	uint8_t buf[TEXT_LINE_MAX];
+	size_t len;
+	size_t line_start; /* buf offset past the last newline */
+	int overrun; /* frame longer than any valid one, dropped at the delimiter */
+	unsigned long frames; /* frames decoded and checked */
+	unsigned long lines; /* text samples */
+	unsigned long errors; /* frames dropped */
+};
+
+/*
+ * Persistent hook, as hidtool monitor -p: one process started with the
+ * command, values are written to its stdin. A record is written only
+ * while fewer than 'depth' records wait in the pipe, others are dropped,
+ * so a slow hook sees fresh values and never stalls reading the line.
+ * Records are shorter than PIPE_BUF, non-blocking writes are all or nothing.
+ */
+enum hook_format
+{
+	HOOK_FORMAT_TEXT, /* "value time\n" */
+	HOOK_FORMAT_BINARY, /* struct hook_record */
+};
+
+/* hidtool's record, the value unsigned: levels are fp_to_uint32() */
+struct hook_record
+{
+	uint32_t seq; /* counts records produced, gaps are drops */
+	uint32_t value;
+	double time; /* CLOCK_MONOTONIC s the period ended */
+};
+
+struct hook
+{
+	char const *command;
+	enum hook_format format;
+	unsigned int depth;
+	pid_t pid; /* 0 - not running */
+	int fd; /* write end of the hook stdin, -1 while the hook is stopping */
+	double restart_at; /* monotonic s the hook may be started again */
+	double kill_at; /* monotonic s a stopping hook gets SIGKILL */
+	uint32_t seq;
+	unsigned long dropped;
+	unsigned int restarts;
+};
+
+/* sample sequence tracking */
+struct sample_stream
+{
+	int synced;
+	uint8_t seq; /* next expected */
+	unsigned long samples;
+	unsigned long lost;
+};
+
+/*
+ * globals
+ */
+static int ARGC_=0;
+static char **ARGV_=0;
+static int g_msglevel = MSG_INFO;
+static volatile sig_atomic_t g_stop = 0;
+static char const *g_device = DEFAULT_TTY;
+static unsigned int g_baud = DEFAULT_BAUD;
+static int g_formats = SERIAL_RX_TEXT | SERIAL_RX_FRAMES;
+static int g_text_base = 10;
+
+/*
+ * prototypes
+ */
+char *shift_argv(void);
+char *shift_argv_n(unsigned n);
+double monotonic_now(void);
+int tty_open(char const *name, unsigned int baud);
+int device_open(void);
+ssize_t device_read(int fd, uint8_t *buf, size_t size);
+int pty_hungup(int master);
+int hook_start(struct hook *hook);
+void hook_reap(struct hook *hook);
+int hook_send(struct hook *hook, uint32_t value, double time);
+uint8_t sframe_crc8(uint8_t crc, uint8_t data);
+size_t sframe_encode(const void *payload, size_t len, uint8_t *out);
+int sframe_decode(const uint8_t *in, size_t n, uint8_t *out, size_t out_size);
+void serial_rx_init(struct serial_rx *rx);
+void serial_rx_feed(struct serial_rx *rx, const uint8_t *data, size_t n, serial_handler handler, void *ctx);
+int serial_text_parse(const uint8_t *line, size_t len, int base, struct serial_sample *sample);
+unsigned int sample_stream_update(struct sample_stream *stream, struct serial_sample const *sample);
+
+/*
+ *
+ * commands
+ *
+ */
+void on_signal(int sig)
+{
+	g_stop = 1;
+}
+
+void stream_handler(void *ctx, struct serial_sample const *sample)
+{
+	const unsigned int lost = sample_stream_update(ctx, sample);
+	if ( lost )
+		WARN("lost %u samples", lost);
+	if ( sample->has_seq )
+		fprintf(stdout, "%3u %2u %3u %10lu\n",
+			sample->seq,
+			sample->prescaler,
+			sample->raw,
+			(unsigned long)sample->level);
+	else
+		fprintf(stdout, "  -  -   - %10lu\n", (unsigned long)sample->level);
+}
+
+/* stream [-n samples], until the device hangs up or that many are read */
+int do_command_stream(int fd)
+{
+	struct serial_rx rx;
+	struct sample_stream stream = { .synced = 0 };
+	uint8_t buf[READ_BUFFER_SIZE];
+	unsigned long limit = 0;
+	int err = 0;
+
+	int ch;
+	while ( (ch=getopt(ARGC_, ARGV_, "n:")) != -1 )
+		switch ( ch )
+		{
+		case 'n':
+			limit = strtoul(optarg, 0, 0);
+			break;
+		default: return -EINVAL;
+		}
+	shift_argv_n(optind);
+
+	serial_rx_init(&rx);
+	while ( !g_stop && !(limit && stream.samples >= limit) )
+	{
+		const ssize_t n = device_read(fd, buf, sizeof(buf));
+		if ( n < 0 )
+		{
+			err = n;
+			ERR("read failure: %d", err);
+			break;
+		}
+		if ( n == 0 )
+			break;
+		serial_rx_feed(&rx, buf, n, stream_handler, &stream);
+		fflush(stdout);
+	}
+
+	MSG("%lu frames, %lu lines, %lu bad, %lu samples lost",
+	    rx.frames, rx.lines, rx.errors, stream.lost);
+	return err;
+}
+
+void count_handler(void *ctx, struct serial_sample const *sample)
+{
+	sample_stream_update(ctx, sample);
+}
+
+/* samples per second delivered over the link: rate [-n samples] */
+int do_command_rate(int fd)
+{
+	struct serial_rx rx;
+	struct sample_stream stream = { .synced = 0 };
+	uint8_t buf[READ_BUFFER_SIZE];
+	unsigned long samples = 0, errors = 0, lost = 0;
+	unsigned long limit = 0;
+	double start = 0;
+	double mark = 0;
+	int err = 0;
+
+	int ch;
+	while ( (ch=getopt(ARGC_, ARGV_, "n:")) != -1 )
+		switch ( ch )
+		{
+		case 'n':
+			limit = strtoul(optarg, 0, 0);
+			break;
+		default: return -EINVAL;
+		}
+	shift_argv_n(optind);
+
+	serial_rx_init(&rx);
+	fprintf(stdout, "%8s %6s %6s\n", "samples/s", "bad", "lost");
+	while ( !g_stop && !(limit && stream.samples >= limit) )
+	{
+		const ssize_t n = device_read(fd, buf, sizeof(buf));
+		if ( n < 0 )
+		{
+			err = n;
+			ERR("read failure: %d", err);
+			break;
+		}
+		if ( n == 0 )
+			break;
+
+		/* time from the first data, the replay may start late */
+		const double now = monotonic_now();
+		if ( !start )
+			start = mark = now;
+		serial_rx_feed(&rx, buf, n, count_handler, &stream);
+
+		if ( now - mark >= 1.0 )
+		{
+			fprintf(stdout, "%9.1f %6lu %6lu\n",
+				(stream.samples - samples) / (now - mark),
+				rx.errors - errors,
+				stream.lost - lost);
+			fflush(stdout);
+			samples = stream.samples;
+			errors = rx.errors;
+			lost = stream.lost;
+			mark = now;
+		}
+	}
+
+	const double elapsed = monotonic_now() - start;
+	if ( start && elapsed > 0 )
+		MSG("%lu samples in %.3f s, %.1f samples/s, %lu bad, %lu lost",
+		    stream.samples, elapsed, stream.samples / elapsed, rx.errors, stream.lost);
+	return err;
+}
+
+/*
+ * averages over a period go to the sinks:
+ * - a persistent hook running the command, records on its stdin
+ * - otherwise stdout
+ * - a log file, "time value" lines, besides either
+ * the device is reopened when it goes away, the hook keeps running
+ */
+struct monitor_sinks
+{
+	FILE *log;
+	struct hook *hook;
+};
+
+void monitor_output(struct monitor_sinks const *sinks, uint32_t value, double time)
+{
+	if ( sinks->log )
+	{
+		struct timespec ts;
+		clock_gettime(CLOCK_REALTIME, &ts);
+		fprintf(sinks->log, "%ld.%03ld %lu\n", (long)ts.tv_sec, ts.tv_nsec / 1000000L, (unsigned long)value);
+		fflush(sinks->log);
+	}
+
+	if ( sinks->hook )
+		hook_send(sinks->hook, value, time);
+	else
+	{
+		fprintf(stdout, "Light level: %lu\n", (unsigned long)value);
+		fflush(stdout);
+	}
+}
+
+struct monitor_state
+{
+	unsigned long long sum;
+	unsigned long count;
+	struct sample_stream stream;
+};
+
+void monitor_handler(void *ctx, struct serial_sample const *sample)
+{
+	struct monitor_state *state = ctx;
+	sample_stream_update(&state->stream, sample);
+	state->sum += sample->level;
+	state->count += 1;
+}
+
+int do_command_monitor(int fd)
+{
+	double period = DEFAULT_SAMPLE_PERIOD;
+	char const *log_name = 0;
+	struct monitor_sinks sinks = { .log = 0 };
+	struct hook hook = { .format = HOOK_FORMAT_TEXT, .depth = 1, .fd = -1 };
+
+	int ch;
+	while ( (ch=getopt(ARGC_, ARGV_, "t:l:p:q:")) != -1 )
+		switch ( ch )
+		{
+		case 't':
+			period = strtod(optarg, 0);
+			if ( period < 0 ) return -EINVAL;
+			break;
+		case 'l':
+			log_name = optarg;
+			break;
+		case 'p':
+			if ( !strcmp(optarg, "text") )
+				hook.format = HOOK_FORMAT_TEXT;
+			else if ( !strcmp(optarg, "binary") )
+				hook.format = HOOK_FORMAT_BINARY;
+			else
+				return -EINVAL;
+			break;
+		case 'q':
+			hook.depth = strtoul(optarg, 0, 0);
+			if ( !hook.depth ) return -EINVAL;
+			break;
+		default: return -EINVAL;
+		}
+	shift_argv_n(optind);
+
+	if ( ARGC_ > 1 )
+	{
+		ERR("hook takes one command argument");
+		return -EINVAL;
+	}
+	if ( log_name && !(sinks.log = fopen(log_name, "a")) )
+	{
+		const int err = -errno;
+		ERR("failed to open log %s: %d", log_name, err);
+		return err;
+	}
+	if ( ARGC_ )
+	{
+		/* a hook gone is found by EPIPE and restarted */
+		signal(SIGPIPE, SIG_IGN);
+		hook.command = ARGV_[0];
+		const int err = hook_start(&hook);
+		if ( err < 0 )
+		{
+			if ( sinks.log )
+				fclose(sinks.log);
+			return err;
+		}
+		sinks.hook = &hook;
+	}
+
+	struct serial_rx rx;
+	struct monitor_state state = { .sum = 0 };
+	uint8_t buf[READ_BUFFER_SIZE];
+	double t_st = monotonic_now();
+	int err = 0;
+
+	serial_rx_init(&rx);
+	while ( !g_stop )
+	{
+		if ( fd < 0 )
+		{
+			usleep(REOPEN_DELAY_US);
+			if ( (fd = device_open()) < 0 )
+				continue;
+			MSG("%s is back", g_device);
+			serial_rx_init(&rx);
+		}
+
+		const ssize_t n = device_read(fd, buf, sizeof(buf));
+		if ( n <= 0 )
+		{
+			if ( fd == STDIN_FILENO )
+				break;
+			WARN("%s went away (%zd), reopening", g_device, n);
+			close(fd);
+			fd = -1;
+			continue;
+		}
+		serial_rx_feed(&rx, buf, n, monitor_handler, &state);
+
+		const double now = monotonic_now();
+		if ( !state.count || now - t_st < period )
+			continue;
+		t_st = now;
+		monitor_output(&sinks, state.sum / state.count, now);
+		state.sum = 0;
+		state.count = 0;
+	}
+
+	if ( fd >= 0 && fd != STDIN_FILENO )
+		close(fd);
+	if ( sinks.log )
+		fclose(sinks.log);
+	/* end of input, the hook finishes on its own */
+	if ( hook.fd >= 0 )
+		close(hook.fd);
+	return err;
+}
+
+/* send cadence commands of serial_api.h, one per argument: F, H10, A4... */
+int do_command_cadence(int fd)
+{
+	char *arg;
+	while ( (arg = shift_argv()) )
+	{
+		char line[16];
+		const int len = snprintf(line, sizeof(line), "%s\r", arg);
+		if ( len <= 1 || len >= sizeof(line) || !strchr((const char[]){ SCMD_FREE, SCMD_HZ, SCMD_TICKS, SCMD_AVERAGE, 0 }, arg[0]) )
+		{
+			ERR("bad cadence command '%s'", arg);
+			return -EINVAL;
+		}
+		if ( write(fd, line, len) != len )
+		{
+			const int err = -errno;
+			ERR("write failure: %d", err);
+			return err;
+		}
+	}
+	return 0;
+}
+
+/*
+ * synthetic device output to stdout: gen [-n samples] [frames|text|hex]
+ * - the level sweeps the fp16 range, frames count seq
+ */
+int do_command_gen(void)
+{
+	unsigned long count = 1000;
+
+	int ch;
+	while ( (ch=getopt(ARGC_, ARGV_, "n:")) != -1 )
+		switch ( ch )
+		{
+		case 'n':
+			count = strtoul(optarg, 0, 0);
+			break;
+		default: return -EINVAL;
+		}
+	shift_argv_n(optind);
+
+	char const *format = ARGV_[0] ? ARGV_[0] : "frames";
+	const int frames = !strcmp(format, "frames");
+	if ( !frames && strcmp(format, "text") && strcmp(format, "hex") )
+	{
+		ERR("bad format '%s'", format);
+		return -EINVAL;
+	}
+
+	/* the firmware starts with a banner */
+	fputs("\r\nMCUSR: P\r\n", stdout);
+	if ( frames )
+		fputc(SFRAME_DELIMITER, stdout);
+
+	for(unsigned long i = 0; i != count; ++i)
+	{
+		const fp16_t value = fp_compose((0x100 + i * 0x130) & FP16_MANTISSA_MASK, (i >> 4) & FP16_EXPONENT_MASK);
+		if ( frames )
+		{
+			ucd_serial_sample_type sample = {
+				.seq = i,
+				.prescaler = 1 + i % 15,
+				.raw = i * 7,
+				.value = value,
+			};
+			uint8_t out[SFRAME_MAX_ENCODED];
+			fwrite(out, sframe_encode(&sample, sizeof(sample), out), 1, stdout);
+		}
+		else
+			fprintf(stdout, strcmp(format, "hex") ? TEXT_PREFIX "%lu\r\n" : TEXT_PREFIX "%08lX\r\n",
+				(unsigned long)fp_to_uint32(value));
+	}
+	return fflush(stdout) ? -errno : 0;
+}
+
+/*
+ * stand-in for the device: replay [-r bytes/s] [-n loops] [-L link] capture
+ * - serves the capture on the slave of a new pseudo terminal, prints its
+ *   name and, with -L, links it at the given path
+ * - bytes per second 0 writes as fast as the reader takes them
+ * - the capture is written once a reader has the slave open, and the
+ *   master stays until it closes it: bytes still in the tty buffers are
+ *   not counted anywhere, so only the reader knows it has them all
+ *   (stream -n, rate -n)
+ */
+int do_command_replay(void)
+{
+	unsigned long rate = 0;
+	unsigned long loops = 1;
+	char const *link = 0;
+	int err = 0;
+
+	int ch;
+	while ( (ch=getopt(ARGC_, ARGV_, "r:n:L:")) != -1 )
+		switch ( ch )
+		{
+		case 'r':
+			rate = strtoul(optarg, 0, 0);
+			break;
+		case 'n':
+			loops = strtoul(optarg, 0, 0);
+			break;
+		case 'L':
+			link = optarg;
+			break;
+		default: return -EINVAL;
+		}
+	shift_argv_n(optind);
+	if ( !ARGV_[0] )
+	{
+		ERR("no capture to replay");
+		return -EINVAL;
+	}
+
+	/* whole capture in memory */
+	FILE *f = fopen(ARGV_[0], "rb");
+	if ( !f )
+	{
+		err = -errno;
+		ERR("failed to open %s: %d", ARGV_[0], err);
+		return err;
+	}
+	uint8_t *data = 0;
+	size_t size = 0;
+	for(;;)
+	{
+		data = realloc(data, size + READ_BUFFER_SIZE);
+		const size_t n = fread(data + size, 1, READ_BUFFER_SIZE, f);
+		size += n;
+		if ( n < READ_BUFFER_SIZE )
+			break;
+	}
+	fclose(f);
+
+	const int master = posix_openpt(O_RDWR | O_NOCTTY);
+	if ( master == -1 || grantpt(master) == -1 || unlockpt(master) == -1 )
+	{
+		err = -errno;
+		ERR("pty failure: %d", err);
+		goto exit_master;
+	}
+	char const *name = ptsname(master);
+
+	/* raw before the reader comes, the setting stays with the master */
+	int slave = open(name, O_RDWR | O_NOCTTY);
+	struct termios tio;
+	if ( slave == -1 || tcgetattr(slave, &tio) == -1 )
+	{
+		err = -errno;
+		ERR("pty slave failure: %d", err);
+		goto exit_slave;
+	}
+	cfmakeraw(&tio);
+	tcsetattr(slave, TCSANOW, &tio);
+	close(slave);
+	slave = -1;
+
+	if ( link )
+	{
+		unlink(link);
+		if ( symlink(name, link) == -1 )
+		{
+			err = -errno;
+			ERR("failed to link %s: %d", link, err);
+			goto exit_master;
+		}
+	}
+	fprintf(stdout, "%s\n", name);
+	fflush(stdout);
+
+	/* the master hangs up while no slave is open */
+	while ( !g_stop && pty_hungup(master) )
+		usleep(10000);
+
+	size_t written = 0;
+	double start = 0;
+	for(unsigned long loop = 0; loop != loops && !g_stop; ++loop)
+	{
+		for(size_t pos = 0; pos != size && !g_stop; )
+		{
+			const size_t chunk = min(size - pos, (size_t)256);
+			const ssize_t n = write(master, data + pos, chunk);
+			if ( n < 0 && errno == EINTR )
+				continue;
+			if ( n < 0 )
+			{
+				err = -errno;
+				ERR("write failure: %d", err);
+				goto exit_link;
+			}
+			if ( !start )
+				start = monotonic_now();
+			pos += n;
+			written += n;
+
+			if ( rate )
+			{
+				const double due = start + (double)written / rate;
+				const double now = monotonic_now();
+				if ( due > now )
+					usleep((useconds_t)((due - now) * 1e6));
+			}
+		}
+	}
+
+	/* tearing down earlier would hang up the reader short of the tail */
+	while ( !g_stop && !pty_hungup(master) )
+		usleep(10000);
+	if ( start )
+		MSG("%zu bytes in %.3f s", written, monotonic_now() - start);
+
+exit_link:
+	if ( link )
+		unlink(link);
+exit_slave:
+	if ( slave != -1 )
+		close(slave);
+exit_master:
+	if ( master != -1 )
+		close(master);
+	free(data);
+	return err;
+}
+
+int do_command(void)
+{
+	int err;
+
+	/* default command */
+	char *command = ARGV_[0];
+	if ( !command )
+		command = "stream";
+
+	/* commands without the device */
+	if ( !strcmp(command, "gen") )
+		return do_command_gen();
+	if ( !strcmp(command, "replay") )
+		return do_command_replay();
+
+	const int fd = device_open();
+	if ( fd < 0 )
+	{
+		ERR("failed to open %s: %d", g_device, fd);
+		return fd;
+	}
+
+	if ( !strcmp(command, "stream") )
+	{
+		err = do_command_stream(fd);
+	}
+	else if ( !strcmp(command, "rate") )
+	{
+		err = do_command_rate(fd);
+	}
+	else if ( !strcmp(command, "monitor") )
+	{
+		/* takes care of the device itself, reopens it */
+		return do_command_monitor(fd);
+	}
+	else if ( !strcmp(command, "cadence") )
+	{
+		err = do_command_cadence(fd);
+	}
+	else
+	{
+		ERR("Bad command '%s'", command);
+		err = -EINVAL;
+	}
+
+	if ( fd != STDIN_FILENO )
+		close(fd);
+	return err;
+}
+
+int main(int argc, char **argv)
+{
+	int err;
+	int ch;
+
+	ARGC_ = argc;
+	ARGV_ = argv;
+
+	while( (ch=getopt(argc, argv, "+d:b:f:Xv")) != -1 )
+	{
+		switch ( ch )
+		{
+		case 'd':
+			g_device = optarg;
+			break;
+		case 'b':
+			g_baud = strtoul(optarg, 0, 0);
+			break;
+		case 'f':
+			if ( !strcmp(optarg, "text") )
+				g_formats = SERIAL_RX_TEXT;
+			else if ( !strcmp(optarg, "frames") )
+				g_formats = SERIAL_RX_FRAMES;
+			else if ( !strcmp(optarg, "auto") )
+				g_formats = SERIAL_RX_TEXT | SERIAL_RX_FRAMES;
+			else
+			{
+				ERR("bad format '%s'", optarg);
+				exit(EXIT_FAILURE);
+			}
+			break;
+		case 'X':
+			/* text of firmware before decimal picofmt */
+			g_text_base = 16;
+			break;
+		case 'v':
+			g_msglevel = MSG_DEBUG;
+			break;
+		default:
+			break;
+		}
+	}
+
+	struct sigaction sa;
+	memset(&sa, 0, sizeof(sa));
+	sa.sa_handler = on_signal;
+	sigaction(SIGINT, &sa, 0);
+	sigaction(SIGTERM, &sa, 0);
+
+	shift_argv_n(optind);
+	optind = 0;
+	err = do_command();
+	if ( err < 0 )
+		exit(EXIT_FAILURE);
+	return 0;
+}
+
+/*
+ *
+ * serial line
+ *
+ */
+int tty_open(char const *name, unsigned int baud)
+{
+	static const struct { unsigned int baud; speed_t speed; } speeds[] = {
+		{ 9600, B9600 }, { 19200, B19200 }, { 38400, B38400 },
+		{ 57600, B57600 }, { 115200, B115200 }, { 230400, B230400 },
+	};
+	speed_t speed = 0;
+	for(size_t i = 0; i != sizeof(speeds)/sizeof(speeds[0]); ++i)
+		if ( speeds[i].baud == baud )
+			speed = speeds[i].speed;
+	if ( !speed )
+		return -EINVAL;
+
+	const int fd = open(name, O_RDWR | O_NOCTTY);
+	if ( fd == -1 )
+		return -errno;
+
+	/*
+	 * raw 8N1, a terminal device name may also be a plain capture file
+	 * - reads return a full VMIN or what came before a 100 ms gap, so a
+	 *   fast stream takes few system calls
+	 */
+	struct termios tio;
+	if ( tcgetattr(fd, &tio) == 0 )
+	{
+		cfmakeraw(&tio);
+		tio.c_cflag |= CLOCAL | CREAD;
+		tio.c_cc[VMIN] = 255;
+		tio.c_cc[VTIME] = 1;
+		cfsetispeed(&tio, speed);
+		cfsetospeed(&tio, speed);
+		if ( tcsetattr(fd, TCSANOW, &tio) == -1 )
+		{
+			const int err = -errno;
+			close(fd);
+			return err;
+		}
+	}
+	return fd;
+}
+
+/* '-' reads a capture from stdin */
+int device_open(void)
+{
+	if ( !strcmp(g_device, "-") )
+		return STDIN_FILENO;
+	return tty_open(g_device, g_baud);
+}
+
+/* returns 0 at the end of a capture and when a terminal hangs up */
+ssize_t device_read(int fd, uint8_t *buf, size_t size)
+{
+	for(;;)
+	{
+		const ssize_t n = read(fd, buf, size);
+		if ( n >= 0 )
+			return n;
+		if ( errno == EIO )
+			return 0;
+		if ( errno != EINTR || g_stop )
+			return -errno;
+	}
+}
+
+/* a pty master polls as hung up while no slave is open */
+int pty_hungup(int master)
+{
+	struct pollfd pfd = { .fd = master, .events = POLLIN };
+	return poll(&pfd, 1, 0) > 0 && (pfd.revents & POLLHUP);
+}
+
+/*
+ *
+ * frames
+ *
+ */
+
+/* polynomial 0x07, msb first, as _crc8_ccitt_update */
+uint8_t sframe_crc8(uint8_t crc, uint8_t data)
+{
+	crc ^= data;
+	for(int i = 0; i != 8; ++i)
+		crc = crc & 0x80 ? (crc << 1) ^ 0x07 : crc << 1;
+	return crc;
+}
+
+/* same as the firmware sframe_send(), out takes SFRAME_MAX_ENCODED */
+size_t sframe_encode(const void *payload, size_t len, uint8_t *out)
+{
+	uint8_t buf[SFRAME_MAX_PAYLOAD + 1];
+	uint8_t crc = 0;
+	size_t i, n = 0;
+
+	memcpy(buf, payload, len);
+	for(i = 0; i != len; ++i)
+		crc = sframe_crc8(crc, buf[i]);
+	buf[len++] = crc;
+
+	i = 0;
+	for(;;)
+	{
+		size_t run = 0;
+		while ( i + run != len && buf[i + run] )
+			++run;
+		out[n++] = run + 1;
+		for(; run; --run)
+			out[n++] = buf[i++];
+		if ( i == len )
+			break;
+		++i;
+	}
+	out[n++] = SFRAME_DELIMITER;
+	return n;
+}
+
+/*
+ * Undo COBS of a frame without its delimiter and check the CRC
+ * - returns payload length, or -1 if the frame is broken
+ */
+int sframe_decode(const uint8_t *in, size_t n, uint8_t *out, size_t out_size)
+{
+	size_t len = 0;
+	size_t i = 0;
+	while ( i != n )
+	{
+		const uint8_t code = in[i++];
+		if ( code == SFRAME_DELIMITER || i + code - 1 > n )
+			return -1;
+		for(uint8_t k = 1; k != code; ++k)
+		{
+			if ( len == out_size )
+				return -1;
+			out[len++] = in[i++];
+		}
+		/* every block but the last one stands for a zero */
+		if ( i != n && code != 0xFF )
+		{
+			if ( len == out_size )
+				return -1;
+			out[len++] = 0;
+		}
+	}
+	if ( len < 1 )
+		return -1;
+
+	uint8_t crc = 0;
+	for(size_t k = 0; k != len - 1; ++k)
+		crc = sframe_crc8(crc, out[k]);
+	return crc == out[len - 1] ? (int)len - 1 : -1;
+}
+
+void serial_rx_init(struct serial_rx *rx)
+{
+	memset(rx, 0, sizeof(*rx));
+	rx->formats = g_formats;
+	rx->text_base = g_text_base;
+}
+
+/* "Light: N", CR included or not */
+int serial_text_parse(const uint8_t *line, size_t len, int base, struct serial_sample *sample)
+{
+	char text[TEXT_LINE_MAX + 1];
+	const size_t prefix = sizeof(TEXT_PREFIX) - 1;
+
+	while ( len && line[len - 1] == '\r' )
+		--len;
+	if ( len <= prefix || len > TEXT_LINE_MAX || memcmp(line, TEXT_PREFIX, prefix) )
+		return 0;
+	memcpy(text, line + prefix, len - prefix);
+	text[len - prefix] = '\0';
+
+	char *end;
+	errno = 0;
+	const unsigned long level = strtoul(text, &end, base);
+	if ( *end || errno || level > UINT32_MAX )
+		return 0;
+
+	memset(sample, 0, sizeof(*sample));
+	sample->level = level;
+	return 1;
+}
+
+void serial_rx_feed(struct serial_rx *rx, const uint8_t *data, size_t n, serial_handler handler, void *ctx)
+{
+	for(size_t i = 0; i != n; ++i)
+	{
+		const uint8_t b = data[i];
+		struct serial_sample sample;
+
+		if ( (rx->formats & SERIAL_RX_FRAMES) && b == SFRAME_DELIMITER )
+		{
+			/* back to back delimiters are idle line, not frames */
+			if ( rx->len || rx->overrun )
+			{
+				uint8_t payload[SFRAME_MAX_PAYLOAD + 1];
+				const int len = rx->overrun ? -1
+					: sframe_decode(rx->buf, rx->len, payload, sizeof(payload));
+				if ( len == sizeof(ucd_serial_sample_type) )
+				{
+					ucd_serial_sample_type frame;
+					memcpy(&frame, payload, sizeof(frame));
+					sample.has_seq = 1;
+					sample.seq = frame.seq;
+					sample.prescaler = frame.prescaler;
+					sample.raw = frame.raw;
+					sample.level = fp_to_uint32(frame.value);
+					++rx->frames;
+					handler(ctx, &sample);
+				}
+				else if ( rx->overrun || rx->len != rx->line_start )
+				{
+					++rx->errors;
+					DBG("bad frame of %zu bytes", rx->len);
+				}
+				/* else text lines, the banner before the first frame */
+			}
+			rx->len = rx->line_start = 0;
+			rx->overrun = 0;
+			continue;
+		}
+
+		if ( (rx->formats & SERIAL_RX_TEXT) && b == '\n' )
+		{
+			if ( serial_text_parse(rx->buf + rx->line_start, rx->len - rx->line_start,
+					       rx->text_base, &sample) )
+			{
+				++rx->lines;
+				handler(ctx, &sample);
+				rx->len = rx->line_start = 0;
+				rx->overrun = 0;
+				continue;
+			}
+			/* other text, or a newline byte inside a frame */
+			if ( !(rx->formats & SERIAL_RX_FRAMES) )
+			{
+				rx->len = rx->line_start = 0;
+				continue;
+			}
+			rx->line_start = rx->len + 1;
+		}
+
+		/* nothing valid is that long, start over and drop the frame at its end */
+		if ( rx->len == sizeof(rx->buf) )
+		{
+			rx->len = rx->line_start = 0;
+			rx->overrun = 1;
+		}
+		rx->buf[rx->len++] = b;
+	}
+}
+
+/* returns the number of samples missing before this one */
+unsigned int sample_stream_update(struct sample_stream *stream, struct serial_sample const *sample)
+{
+	unsigned int lost = 0;
+	stream->samples += 1;
+	if ( !sample->has_seq )
+		return 0;
+	if ( stream->synced )
+		lost = (uint8_t)(sample->seq - stream->seq);
+	stream->synced = 1;
+	stream->seq = sample->seq + 1;
+	stream->lost += lost;
+	return lost;
+}
+
+/*
+ *
+ * Hook process functions
+ *
+ */
+
+int hook_start(struct hook *hook)
+{
+	int pipefd[2];
+	if ( pipe(pipefd) == -1 )
+		return -errno;
+
+	pid_t pid = fork();
+	if ( pid == -1 )
+	{
+		int err = -errno;
+		WARN("fork error %d", err);
+		close(pipefd[0]);
+		close(pipefd[1]);
+		return err;
+	}
+	if ( pid == 0 )
+	{
+		dup2(pipefd[0], STDIN_FILENO);
+		close(pipefd[0]);
+		close(pipefd[1]);
+		signal(SIGPIPE, SIG_DFL);
+		execl("/bin/sh", "/bin/sh", "-c", hook->command, (char *)0);
+		_exit(127);
+	}
+
+	close(pipefd[0]);
+	fcntl(pipefd[1], F_SETFL, O_NONBLOCK);
+	fcntl(pipefd[1], F_SETFD, FD_CLOEXEC);
+	/* the smallest pipe the kernel gives, stale values do not pile up */
+	fcntl(pipefd[1], F_SETPIPE_SZ, 0);
+	hook->fd = pipefd[1];
+	hook->pid = pid;
+	DBG("hook started, pid %d", (int)pid);
+	return 0;
+}
+
+/*
+ * Collect the hook process if it has exited, never waits for it
+ */
+void hook_reap(struct hook *hook)
+{
+	int status;
+	if ( !hook->pid || waitpid(hook->pid, &status, WNOHANG) <= 0 )
+		return;
+
+	if ( WIFEXITED(status) )
+		WARN("hook exited with status %d", WEXITSTATUS(status));
+	else if ( WIFSIGNALED(status) )
+		WARN("hook killed by signal %d", WTERMSIG(status));
+	hook->pid = 0;
+	if ( hook->fd >= 0 )
+		close(hook->fd);
+	hook->fd = -1;
+	hook->restart_at = monotonic_now() + HOOK_RESTART_DELAY;
+}
+
+/*
+ * \return >0 record written
+ *         =0 record dropped: hook behind or restarting
+ *         <0 error
+ */
+int hook_send(struct hook *hook, uint32_t value, double time)
+{
+	struct hook_record rec = { .seq = hook->seq++, .value = value, .time = time };
+	char text[48];
+	void const *buf = &rec;
+	size_t len = sizeof(rec);
+
+	hook_reap(hook);
+	if ( hook->pid && hook->fd < 0 )
+	{
+		/* still stopping, a hook ignoring SIGTERM does not stall reading */
+		if ( monotonic_now() >= hook->kill_at )
+		{
+			kill(hook->pid, SIGKILL);
+			hook->kill_at = monotonic_now() + HOOK_RESTART_DELAY;
+		}
+		goto dropped;
+	}
+	if ( !hook->pid )
+	{
+		if ( monotonic_now() < hook->restart_at )
+			goto dropped;
+		int err = hook_start(hook);
+		if ( err < 0 )
+		{
+			hook->restart_at = monotonic_now() + HOOK_RESTART_DELAY;
+			return err;
+		}
+		MSG("hook restarted (%u)", ++hook->restarts);
+	}
+
+	if ( HOOK_FORMAT_TEXT == hook->format )
+	{
+		len = snprintf(text, sizeof(text), "%lu %.3f\n", (unsigned long)value, time);
+		buf = text;
+	}
+
+	/* backpressure: hook has not taken what it was given yet */
+	int queued = 0;
+	if ( ioctl(hook->fd, FIONREAD, &queued) == 0 && queued + len > hook->depth * len )
+		goto dropped;
+
+	if ( write(hook->fd, buf, len) == -1 )
+	{
+		if ( EPIPE == errno )
+		{
+			/* stdin closed or hook gone, collected and restarted later */
+			kill(hook->pid, SIGTERM);
+			close(hook->fd);
+			hook->fd = -1;
+			hook->kill_at = monotonic_now() + HOOK_RESTART_DELAY;
+		}
+		else if ( EAGAIN != errno )
+		{
+			int err = -errno;
+			WARN("hook write error %d", err);
+			return err;
+		}
+		goto dropped;
+	}
+	return 1;
+
+dropped:
+	/* powers of two only, a slow hook does not flood the log */
+	hook->dropped++;
+	if ( !(hook->dropped & (hook->dropped - 1)) )
+		MSG("hook dropped %lu records", hook->dropped);
+	return 0;
+}
+
+/*
+ *
+ * utility
+ *
+ */
+double monotonic_now(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+char *shift_argv_n(unsigned n)
+{
+	if ( ARGC_ < n )
+		return 0;
+	ARGC_ -= n;
+	ARGV_ += n;
+	return *ARGV_;
+}
+
+char *shift_argv(void)
+{
+	return shift_argv_n(1);
+}
@@ -0,0 +1,177 @@
+#include "sensor-device.h"
+#include <QtCore>
+#include <cstring>
+#include <cstddef>
+#include <cerrno>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <linux/hiddev.h>
+#include <linux/usb/ch9.h>
+#include <linux/usbdevice_fs.h>
+
+#define SENSOR_VID 0x16C0
+#define SENSOR_PID 0x05DF
+#define USBDEV_TIMEOUT_MS 1000
+
+SensorDevice::SensorDevice(QObject *parent)
+	: QObject(parent)
+	, fd(-1)
+	, usbfd(-1)
+	, notifier(0)
+	, header_count(0)
+	, sample_count(0)
+{
+	memset(&device_caps, 0, sizeof(device_caps));
+}
+
+SensorDevice::~SensorDevice()
+{
+	delete notifier;
+	if ( usbfd >= 0 )
+		::close(usbfd);
+	if ( fd >= 0 )
+		::close(fd);
+}
+
+bool SensorDevice::open(const QString &directory)
+{
+	QDir dir(directory);
+	foreach( const QString &name, dir.entryList(QStringList("hiddev*"), QDir::System) )
+	{
+		if ( openNode(dir.filePath(name)) )
+			return true;
+	}
+	return false;
+}
+
+bool SensorDevice::openNode(const QString &name)
+{
+	fd = ::open(QFile::encodeName(name).constData(), O_RDONLY);
+	if ( fd == -1 )
+		return false;
+
+	struct hiddev_devinfo info;
+	if ( ioctl(fd, HIDIOCGDEVINFO, &info) == -1
+	     || (info.vendor & 0xFFFF) != SENSOR_VID
+	     || (info.product & 0xFFFF) != SENSOR_PID )
+	{
+		::close(fd);
+		fd = -1;
+		return false;
+	}
+
+	// vendor requests go around hiddev, through usbfs
+	const QString usbname = QString("/dev/bus/usb/%1/%2")
+		.arg(info.busnum, 3, 10, QChar('0'))
+		.arg(info.devnum, 3, 10, QChar('0'));
+	usbfd = ::open(QFile::encodeName(usbname).constData(), O_RDWR);
+
+	readCaps();
+
+	notifier = new QSocketNotifier(fd, QSocketNotifier::Read, this);
+	connect(notifier, SIGNAL(activated(int)), this, SLOT(readEvents()));
+	return true;
+}
+
+// read capabilities once, keep the fastest subrequest path the firmware has
+bool SensorDevice::readCaps()
+{
+	int len = -1;
+	if ( usbfd >= 0 )
+		len = vendorGet(UCD_SUBRQ_CAPS, &device_caps, sizeof(device_caps));
+	if ( len != sizeof(device_caps) )
+		len = featureGet(UCD_SUBRQ_CAPS, &device_caps, sizeof(device_caps));
+
+	const bool valid = len == sizeof(device_caps)
+		&& (device_caps.version >> 8) == (UCD_PROTOCOL_VERSION >> 8);
+	if ( !valid )
+		memset(&device_caps, 0, sizeof(device_caps));
+	if ( !(device_caps.features & UCD_FEATURE_VENDOR_RQ) && usbfd >= 0 )
+	{
+		::close(usbfd);
+		usbfd = -1;
+	}
+	return valid;
+}
+
+int SensorDevice::vendorGet(uint8_t subrq_id, void *buffer, size_t length)
+{
+	struct usbdevfs_ctrltransfer ctrl;
+	ctrl.bRequestType = USB_DIR_IN | USB_TYPE_VENDOR | USB_RECIP_DEVICE;
+	ctrl.bRequest = UCD_VENDOR_RQ_GET;
+	ctrl.wValue = subrq_id;
+	ctrl.wIndex = 0;
+	ctrl.wLength = qMin(length, (size_t)UCD_FEATURE_REPORT_COUNT);
+	ctrl.timeout = USBDEV_TIMEOUT_MS;
+	ctrl.data = buffer;
+	const int r = ioctl(usbfd, USBDEVFS_CONTROL, &ctrl);
+	return r < 0 ? -errno : r;
+}
+
+// select the subrequest with the mux report, then fetch the data report
+int SensorDevice::featureGet(uint8_t subrq_id, void *buffer, size_t length)
+{
+	struct hiddev_report_info rinfo;
+	struct hiddev_usage_ref_multi ref;
+
+	memset(&ref, 0, sizeof(ref));
+	ref.uref.report_type = HID_REPORT_TYPE_FEATURE;
+	ref.uref.report_id = UCD_SUBRQ_MUX_REPORT_ID;
+	ref.num_values = 1;
+	ref.values[0] = subrq_id;
+	rinfo.report_type = HID_REPORT_TYPE_FEATURE;
+	rinfo.report_id = UCD_SUBRQ_MUX_REPORT_ID;
+	rinfo.num_fields = 1;
+	if ( ioctl(fd, HIDIOCSUSAGES, &ref) == -1 || ioctl(fd, HIDIOCSREPORT, &rinfo) == -1 )
+		return -errno;
+
+	ref.uref.report_id = UCD_SUBRQ_DATA_REPORT_ID;
+	ref.num_values = UCD_FEATURE_REPORT_COUNT;
+	rinfo.report_id = UCD_SUBRQ_DATA_REPORT_ID;
+	if ( ioctl(fd, HIDIOCGREPORT, &rinfo) == -1 || ioctl(fd, HIDIOCGUSAGES, &ref) == -1 )
+		return -errno;
+
+	// values are int32, one per byte
+	const size_t n = qMin(length, (size_t)UCD_FEATURE_REPORT_COUNT);
+	for(size_t i = 0; i != n; ++i)
+		static_cast<uint8_t *>(buffer)[i] = ref.values[i];
+	return n;
+}
+
+// hiddev delivers one event per usage in report order
+void SensorDevice::readEvents()
+{
+	struct hiddev_event events[16];
+	const ssize_t len = ::read(fd, events, sizeof(events));
+	if ( len <= 0 )
+		return;
+
+	for(size_t i = 0; i != len / sizeof(events[0]); ++i)
+	{
+		const unsigned int usage = events[i].hid & 0xFFFF;
+		const int value = events[i].value;
+		if ( !(device_caps.formats & (UCD_FORMAT_BATCH | UCD_FORMAT_CHANNELS)) )
+		{
+			// single sample reports of older firmware
+			if ( UCD_USAGE_SAMPLE == usage )
+				emit valueUpdated(value);
+			continue;
+		}
+
+		// batches: header tells how many of the samples are valid
+		if ( UCD_USAGE_HEADER == usage )
+		{
+			if ( sample_count || header_count == UCD_INPUT_HEADER_SIZE )
+				header_count = sample_count = 0;
+			header[header_count++] = value;
+		}
+		else if ( UCD_USAGE_SAMPLE == usage && header_count == UCD_INPUT_HEADER_SIZE )
+		{
+			// rounds over channels: channel 0 is the light level
+			const bool wanted = !(device_caps.formats & UCD_FORMAT_CHANNELS) || !sample_count;
+			if ( sample_count++ < header[offsetof(ucd_input_report_type, count)] && wanted )
+				emit valueUpdated(value);
+		}
+	}
+}
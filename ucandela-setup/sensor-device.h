@@ -0,0 +1,49 @@
+#ifndef SENSOR_DEVICE_H_INC
+#define SENSOR_DEVICE_H_INC
+
+#include <QObject>
+#include <QString>
+#include "ucd_api.h"
+
+class QSocketNotifier;
+
+class SensorDevice : public QObject
+{
+	Q_OBJECT;
+public:
+	explicit SensorDevice(QObject *parent=0);
+	~SensorDevice();
+
+	// find the sensor among hiddev nodes and start reading samples
+	bool open(const QString &directory = "/dev/usb");
+
+	// zero version if the firmware does not report capabilities
+	inline const ucd_caps_request_type &caps() const
+	{
+		return device_caps;
+	}
+
+signals:
+	void valueUpdated(int value);
+
+private slots:
+	void readEvents();
+
+private: // internal mechanics
+	bool openNode(const QString &name);
+	bool readCaps();
+	int vendorGet(uint8_t subrq_id, void *buffer, size_t length);
+	int featureGet(uint8_t subrq_id, void *buffer, size_t length);
+
+private: // data
+	int fd;
+	int usbfd; // usbfs node for vendor requests, -1 if not used
+	QSocketNotifier *notifier;
+	ucd_caps_request_type device_caps;
+	// input report being received, header first
+	uint8_t header[UCD_INPUT_HEADER_SIZE];
+	unsigned int header_count;
+	unsigned int sample_count;
+};
+
+#endif // SENSOR_DEVICE_H_INC
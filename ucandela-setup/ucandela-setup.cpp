@@ -2,22 +2,32 @@
 #include <cstdlib>
 #include "mainwindow.h"
 #include "emu-window.h"
+#include "sensor-device.h"
 
 int main(int argc, char **argv)
 {
 	Q_INIT_RESOURCE(ucandela_setup);
 	QApplication app(argc,argv);
 	MainWindow wnd;
+	SensorDevice sensor;
+	EmulatorWindow *emu = 0;
 
-#define EMULATE_SENSOR
-#ifdef  EMULATE_SENSOR
-	EmulatorWindow emu;
-	QObject::connect(&emu, SIGNAL(valueUpdated(int)), &wnd, SLOT(valueChanged(int)));
-//	QObject::connect(&wnd, SIGNAL(close()), &app, SIGNAL(closeAllWindows()));
-//	QObject::connect(&emu, SIGNAL(close()), &app, SIGNAL(closeAllWindows()));
-#endif
+	if ( sensor.open() )
+	{
+		QObject::connect(&sensor, SIGNAL(valueUpdated(int)), &wnd, SLOT(valueChanged(int)));
+	}
+	else
+	{
+		// no sensor attached, emulate one
+		emu = new EmulatorWindow();
+		QObject::connect(emu, SIGNAL(valueUpdated(int)), &wnd, SLOT(valueChanged(int)));
+//		QObject::connect(&wnd, SIGNAL(close()), &app, SIGNAL(closeAllWindows()));
+//		QObject::connect(emu, SIGNAL(close()), &app, SIGNAL(closeAllWindows()));
+		emu->show();
+	}
 
 	wnd.show();
-	emu.show();
-	return app.exec();
+	const int ret = app.exec();
+	delete emu;
+	return ret;
 }
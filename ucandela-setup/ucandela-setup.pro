@@ -5,7 +5,7 @@
 TEMPLATE = app
 TARGET = ucandela-setup
 DEPENDPATH += .
-INCLUDEPATH += .
+INCLUDEPATH += . ../firmware
 
 # Input
 SOURCES += ucandela-setup.cpp
@@ -13,11 +13,13 @@ SOURCES += mainwindow.cpp \
 	   chartwidget.cpp \
            emu-window.cpp \
            plot2d.cpp \
+           sensor-device.cpp \
 
 HEADERS += mainwindow.h \
 	   chartwidget.h \
            emu-window.h \
            plot2d.h \
+           sensor-device.h \
 
 RESOURCES += ucandela-setup.qrc
 FORMS += mainwindow.ui